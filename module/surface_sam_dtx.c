@@ -58,6 +58,7 @@
 #define DTX_CLIENT_BUF_SIZE				16
 
 #define DTX_CONNECT_OPMODE_DELAY			1000
+#define DTX_OPMODE_CACHE_TTL				1000	// ms, invalidated on event
 
 #define DTX_ERR		KERN_ERR "surface_sam_dtx: "
 #define DTX_WARN	KERN_WARNING "surface_sam_dtx: "
@@ -415,6 +416,9 @@ static int surface_dtx_evt_dtx(struct surface_sam_ssh_event *in_event, void *dat
 	struct surface_dtx_dev *ddev = data;
 	struct surface_dtx_event event;
 
+	// any change of the base may change the operation mode
+	surface_sam_ssh_cache_invalidate(SAM_RQST_DTX_TC, SAM_RQST_DTX_CID_GET_OPMODE);
+
 	switch (in_event->cid) {
 	case SAM_EVENT_DTX_CID_CONNECTION:
 	case SAM_EVENT_DTX_CID_BUTTON:
@@ -444,16 +448,27 @@ static int surface_dtx_evt_dtx(struct surface_sam_ssh_event *in_event, void *dat
 			msleep(DTX_CONNECT_OPMODE_DELAY);
 		}
 
+		// drop anything read during the delay
+		surface_sam_ssh_cache_invalidate(SAM_RQST_DTX_TC, SAM_RQST_DTX_CID_GET_OPMODE);
 		surface_dtx_update_opmpde(ddev);
 	}
 
 	return 0;
 }
 
+static const struct surface_sam_ssh_cache_rule surface_dtx_cache[] = {
+	{ SAM_RQST_DTX_TC, SAM_RQST_DTX_CID_GET_OPMODE, DTX_OPMODE_CACHE_TTL },
+};
+
 static int surface_dtx_events_setup(struct surface_dtx_dev *ddev)
 {
 	int status;
 
+	status = surface_sam_ssh_cache_register(surface_dtx_cache, ARRAY_SIZE(surface_dtx_cache));
+	if (status) {
+		goto err_cache;
+	}
+
 	status = surface_sam_ssh_set_event_handler(SAM_EVENT_DTX_RQID, surface_dtx_evt_dtx, ddev);
 	if (status) {
 		goto err_handler;
@@ -469,6 +484,8 @@ static int surface_dtx_events_setup(struct surface_dtx_dev *ddev)
 err_source:
 	surface_sam_ssh_remove_event_handler(SAM_EVENT_DTX_RQID);
 err_handler:
+	surface_sam_ssh_cache_unregister(surface_dtx_cache);
+err_cache:
 	return status;
 }
 
@@ -476,6 +493,7 @@ static void surface_dtx_events_disable(void)
 {
 	surface_sam_ssh_disable_event_source(SAM_EVENT_DTX_TC, 0x01, SAM_EVENT_DTX_RQID);
 	surface_sam_ssh_remove_event_handler(SAM_EVENT_DTX_RQID);
+	surface_sam_ssh_cache_unregister(surface_dtx_cache);
 }
 
 
@@ -35,6 +35,8 @@ static const guid_t SAN_DSM_UUID =
 #define SAM_EVENT_TEMP_TC		0x03
 #define SAM_EVENT_TEMP_RQID		0x0003
 #define SAM_EVENT_TEMP_CID_NOTIFY_SENSOR_TRIP_POINT	0x0b
+#define SAM_EVENT_TEMP_RATE		10	// events per second
+#define SAM_EVENT_TEMP_BURST		20
 
 #define SAN_RQST_TAG			"surface_sam_san: rqst: "
 #define SAN_RQSG_TAG			"surface_sam_san: rqsg: "
@@ -67,6 +69,7 @@ struct san_drvdata {
 	struct san_opreg_context opreg_ctx;
 	struct san_consumers consumers;
 	bool has_power_events;
+	struct surface_sam_ssh_event_notifier power_nf;
 };
 
 struct gsb_data_in {
@@ -599,17 +602,28 @@ san_opreg_handler(u32 function, acpi_physical_address command,
 
 static int san_enable_power_events(struct platform_device *pdev)
 {
+	struct san_drvdata *drvdata = platform_get_drvdata(pdev);
+	struct surface_sam_ssh_event_notifier *nf = &drvdata->power_nf;
 	int status;
 
-	status = surface_sam_ssh_set_delayed_event_handler(
-			SAM_EVENT_PWR_RQID, san_evt_power,
-			san_evt_power_delay, &pdev->dev);
+	nf->rqid = SAM_EVENT_PWR_RQID;
+	nf->tc = SAM_EVENT_PWR_TC;
+	nf->priority = SURFACE_SAM_PRIORITY_NORMAL;
+	nf->cid_mask = NULL;
+	nf->handler = san_evt_power;
+	nf->delay = san_evt_power_delay;
+	nf->data = &pdev->dev;
+
+	// only the latest of multiple pending battery/adapter updates matters
+	nf->coalesce = SURFACE_SAM_SSH_EVENT_COALESCE_LATEST;
+
+	status = surface_sam_ssh_notifier_register(nf);
 	if (status)
 		return status;
 
 	status = surface_sam_ssh_enable_event_source(SAM_EVENT_PWR_TC, 0x01, SAM_EVENT_PWR_RQID);
 	if (status) {
-		surface_sam_ssh_remove_event_handler(SAM_EVENT_PWR_RQID);
+		surface_sam_ssh_notifier_unregister(nf);
 		return status;
 	}
 
@@ -626,6 +640,14 @@ static int san_enable_thermal_events(struct platform_device *pdev)
 	if (status)
 		return status;
 
+	// each event triggers an ACPI notification, don't let trip points flood us
+	status = surface_sam_ssh_set_event_ratelimit(SAM_EVENT_TEMP_RQID,
+			SAM_EVENT_TEMP_RATE, SAM_EVENT_TEMP_BURST);
+	if (status) {
+		surface_sam_ssh_remove_event_handler(SAM_EVENT_TEMP_RQID);
+		return status;
+	}
+
 	status = surface_sam_ssh_enable_event_source(SAM_EVENT_TEMP_TC, 0x01, SAM_EVENT_TEMP_RQID);
 	if (status) {
 		surface_sam_ssh_remove_event_handler(SAM_EVENT_TEMP_RQID);
@@ -635,10 +657,12 @@ static int san_enable_thermal_events(struct platform_device *pdev)
 	return 0;
 }
 
-static void san_disable_power_events(void)
+static void san_disable_power_events(struct platform_device *pdev)
 {
+	struct san_drvdata *drvdata = platform_get_drvdata(pdev);
+
 	surface_sam_ssh_disable_event_source(SAM_EVENT_PWR_TC, 0x01, SAM_EVENT_PWR_RQID);
-	surface_sam_ssh_remove_event_handler(SAM_EVENT_PWR_RQID);
+	surface_sam_ssh_notifier_unregister(&drvdata->power_nf);
 }
 
 static void san_disable_thermal_events(void)
@@ -682,7 +706,7 @@ static void san_disable_events(struct platform_device *pdev)
 
 	san_disable_thermal_events();
 	if (drvdata->has_power_events)
-		san_disable_power_events();
+		san_disable_power_events(pdev);
 }
 
 
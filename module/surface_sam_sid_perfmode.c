@@ -13,6 +13,11 @@
 
 #define SID_PARAM_PERM		(S_IRUGO | S_IWUSR)
 
+#define SAM_PERF_MODE_TC		0x03
+#define SAM_PERF_MODE_CID_GET		0x02
+#define SAM_PERF_MODE_CID_SET		0x03
+#define SAM_PERF_MODE_CACHE_TTL		1000	// ms, invalidated on set
+
 enum sam_perf_mode {
 	SAM_PERF_MODE_NORMAL   = 1,
 	SAM_PERF_MODE_BATTERY  = 2,
@@ -41,8 +46,8 @@ static int surface_sam_perf_mode_get(void)
 	int status;
 
 	struct surface_sam_ssh_rqst rqst = {
-		.tc  = 0x03,
-		.cid = 0x02,
+		.tc  = SAM_PERF_MODE_TC,
+		.cid = SAM_PERF_MODE_CID_GET,
 		.iid = 0x00,
 		.pri = SURFACE_SAM_PRIORITY_NORMAL,
 		.snc = 0x01,
@@ -71,10 +76,11 @@ static int surface_sam_perf_mode_get(void)
 static int surface_sam_perf_mode_set(int perf_mode)
 {
 	u8 payload[4] = { 0 };
+	int status;
 
 	struct surface_sam_ssh_rqst rqst = {
-		.tc  = 0x03,
-		.cid = 0x03,
+		.tc  = SAM_PERF_MODE_TC,
+		.cid = SAM_PERF_MODE_CID_SET,
 		.iid = 0x00,
 		.pri = SURFACE_SAM_PRIORITY_NORMAL,
 		.snc = 0x00,
@@ -87,9 +93,16 @@ static int surface_sam_perf_mode_set(int perf_mode)
 	}
 
 	put_unaligned_le32(perf_mode, &rqst.pld[0]);
-	return surface_sam_ssh_rqst(&rqst, NULL);
+	status = surface_sam_ssh_rqst(&rqst, NULL);
+
+	surface_sam_ssh_cache_invalidate(SAM_PERF_MODE_TC, SAM_PERF_MODE_CID_GET);
+	return status;
 }
 
+static const struct surface_sam_ssh_cache_rule surface_sam_perf_mode_cache[] = {
+	{ SAM_PERF_MODE_TC, SAM_PERF_MODE_CID_GET, SAM_PERF_MODE_CACHE_TTL },
+};
+
 
 static int param_perf_mode_set(const char *val, const struct kernel_param *kp)
 {
@@ -181,11 +194,17 @@ static int surface_sam_sid_perfmode_probe(struct platform_device *pdev)
 		return status == -ENXIO ? -EPROBE_DEFER : status;
 	}
 
+	status = surface_sam_ssh_cache_register(surface_sam_perf_mode_cache,
+			ARRAY_SIZE(surface_sam_perf_mode_cache));
+	if (status) {
+		return status;
+	}
+
 	// set initial perf_mode
 	if (param_perf_mode_init != SID_PARAM_PERF_MODE_AS_IS) {
 		status = surface_sam_perf_mode_set(param_perf_mode_init);
 		if (status) {
-			return status;
+			goto err_set;
 		}
 	}
 
@@ -199,6 +218,8 @@ static int surface_sam_sid_perfmode_probe(struct platform_device *pdev)
 
 err_sysfs:
 	surface_sam_perf_mode_set(param_perf_mode_exit);
+err_set:
+	surface_sam_ssh_cache_unregister(surface_sam_perf_mode_cache);
 	return status;
 }
 
@@ -206,6 +227,7 @@ static int surface_sam_sid_perfmode_remove(struct platform_device *pdev)
 {
 	sysfs_remove_file(&pdev->dev.kobj, &dev_attr_perf_mode.attr);
 	surface_sam_perf_mode_set(param_perf_mode_exit);
+	surface_sam_ssh_cache_unregister(surface_sam_perf_mode_cache);
 	return 0;
 }
 
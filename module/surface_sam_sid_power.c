@@ -27,6 +27,7 @@ module_param(cache_time, uint, 0644);
 MODULE_PARM_DESC(cache_time, "battery state chaching time in milliseconds [default: 1000]");
 
 #define SPWR_AC_BAT_UPDATE_DELAY	msecs_to_jiffies(5000)
+#define SPWR_PSRC_CACHE_TTL		1000	// ms, invalidated on adapter event
 
 
 /*
@@ -120,10 +121,11 @@ static int sam_psy_get_sta(u8 iid, u32 *sta)
 	result.len = 0;
 	result.data = (u8 *)sta;
 
-	return surface_sam_ssh_rqst(&rqst, &result);
+	return surface_sam_ssh_rqst_shared(&rqst, &result);
 }
 
 /* Get battery static information (_BIX) */
+__always_unused
 static int sam_psy_get_bix(u8 iid, struct spwr_bix *bix)
 {
 	struct surface_sam_ssh_rqst rqst;
@@ -145,6 +147,7 @@ static int sam_psy_get_bix(u8 iid, struct spwr_bix *bix)
 }
 
 /* Get battery dynamic information (_BST) */
+__always_unused
 static int sam_psy_get_bst(u8 iid, struct spwr_bst *bst)
 {
 	struct surface_sam_ssh_rqst rqst;
@@ -165,6 +168,62 @@ static int sam_psy_get_bst(u8 iid, struct spwr_bst *bst)
 	return surface_sam_ssh_rqst(&rqst, &result);
 }
 
+/*
+ * Get battery dynamic information (_BST), optionally also status (_STA) and
+ * static information (_BIX), in one batch. The individual status of each
+ * request is returned via status, as _BIX and _BST are only valid if the
+ * battery is present.
+ */
+static int sam_psy_get_sta_bix_bst(u8 iid, u32 *sta, struct spwr_bix *bix,
+				   struct spwr_bst *bst, int *status)
+{
+	struct surface_sam_ssh_rqst rqst[3];
+	struct surface_sam_ssh_buf result[3];
+	struct surface_sam_ssh_buf *results[3];
+	unsigned int n = 0;
+	int st[3];
+	int i, ret;
+
+	if (sta) {
+		rqst[n].cid = SAM_RQST_PWR_CID_STA;
+		result[n].cap = sizeof(u32);
+		result[n].data = (u8 *)sta;
+		n++;
+	}
+
+	if (bix) {
+		rqst[n].cid = SAM_RQST_PWR_CID_BIX;
+		result[n].cap = sizeof(struct spwr_bix);
+		result[n].data = (u8 *)bix;
+		n++;
+	}
+
+	rqst[n].cid = SAM_RQST_PWR_CID_BST;
+	result[n].cap = sizeof(struct spwr_bst);
+	result[n].data = (u8 *)bst;
+	n++;
+
+	for (i = 0; i < n; i++) {
+		rqst[i].tc  = SAM_PWR_TC;
+		rqst[i].iid = iid;
+		rqst[i].pri = SURFACE_SAM_PRIORITY_NORMAL;
+		rqst[i].snc = 0x01;
+		rqst[i].cdl = 0x00;
+		rqst[i].pld = NULL;
+
+		result[i].len = 0;
+		results[i] = &result[i];
+	}
+
+	ret = surface_sam_ssh_rqst_batch(rqst, results, st, n);
+
+	status[0] = sta ? st[0] : 0;
+	status[1] = bix ? st[n - 2] : 0;
+	status[2] = st[n - 1];
+
+	return ret;
+}
+
 /* Set battery trip point (_BTP) */
 static int sam_psy_set_btp(u8 iid, u32 btp)
 {
@@ -199,7 +258,7 @@ static int sam_psy_get_psrc(u8 iid, u32 *psrc)
 	result.len = 0;
 	result.data = (u8 *)psrc;
 
-	return surface_sam_ssh_rqst(&rqst, &result);
+	return surface_sam_ssh_rqst_shared(&rqst, &result);
 }
 
 /* Get maximum platform power for battery (DPTF PMAX) */
@@ -334,6 +393,7 @@ struct spwr_subsystem {
 	unsigned refcount;
 	struct spwr_ac_device *ac;
 	struct spwr_battery_device *battery[__SPWR_NUM_BAT];
+	struct surface_sam_ssh_event_notifier notif;
 };
 
 static struct spwr_subsystem spwr_subsystem = {
@@ -393,25 +453,54 @@ inline static bool spwr_battery_present(struct spwr_battery_device *bat)
 }
 
 
-inline static int spwr_battery_load_sta(struct spwr_battery_device *bat)
+/*
+ * Load _STA and _BST, and _BIX if requested, with a single batched round of
+ * requests. If the battery has been absent (e.g. the base battery while the
+ * base is detached), only _STA is requested first, and _BIX and _BST are
+ * batched only if the battery has become present. _BIX and _BST are only
+ * updated if the battery is present.
+ */
+static int spwr_battery_load_batched(struct spwr_battery_device *bat, bool with_bix)
 {
-	return sam_psy_get_sta(bat->id + 1, &bat->sta);
-}
+	bool known_present = spwr_battery_present(bat);
+	struct spwr_bix bix;
+	struct spwr_bst bst;
+	int status[3];
+	u32 sta;
 
-inline static int spwr_battery_load_bix(struct spwr_battery_device *bat)
-{
-	if (!spwr_battery_present(bat))
-		return 0;
+	if (!known_present) {
+		status[0] = sam_psy_get_sta(bat->id + 1, &sta);
+		if (status[0])
+			return status[0];
 
-	return sam_psy_get_bix(bat->id + 1, &bat->bix);
-}
+		bat->sta = sta;
+		if (!spwr_battery_present(bat))
+			return 0;
+	}
+
+	sam_psy_get_sta_bix_bst(bat->id + 1, known_present ? &sta : NULL,
+				with_bix ? &bix : NULL, &bst, status);
+
+	if (status[0])
+		return status[0];
+
+	if (known_present)
+		bat->sta = sta;
 
-inline static int spwr_battery_load_bst(struct spwr_battery_device *bat)
-{
 	if (!spwr_battery_present(bat))
 		return 0;
 
-	return sam_psy_get_bst(bat->id + 1, &bat->bst);
+	if (status[1])
+		return status[1];
+
+	if (status[2])
+		return status[2];
+
+	if (with_bix)
+		bat->bix = bix;
+
+	bat->bst = bst;
+	return 0;
 }
 
 
@@ -440,11 +529,7 @@ inline static int spwr_battery_update_bst_unlocked(struct spwr_battery_device *b
 	if (cached && bat->timestamp && time_is_after_jiffies(cache_deadline))
 		return 0;
 
-	status = spwr_battery_load_sta(bat);
-	if (status)
-		return status;
-
-	status = spwr_battery_load_bst(bat);
+	status = spwr_battery_load_batched(bat, false);
 	if (status)
 		return status;
 
@@ -467,15 +552,7 @@ inline static int spwr_battery_update_bix_unlocked(struct spwr_battery_device *b
 {
 	int status;
 
-	status = spwr_battery_load_sta(bat);
-	if (status)
-		return status;
-
-	status = spwr_battery_load_bix(bat);
-	if (status)
-		return status;
-
-	status = spwr_battery_load_bst(bat);
+	status = spwr_battery_load_batched(bat, true);
 	if (status)
 		return status;
 
@@ -597,6 +674,8 @@ static int spwr_handle_event_adapter(struct surface_sam_ssh_event *event)
 	struct spwr_ac_device *ac;
 	int status = 0;
 
+	surface_sam_ssh_cache_invalidate(SAM_PWR_TC, SAM_RQST_PWR_CID_PSRC);
+
 	mutex_lock(&spwr_subsystem.lock);
 
 	ac = spwr_subsystem.ac;
@@ -894,11 +973,30 @@ static const struct device_attribute alarm_attr = {
 };
 
 
+static const struct surface_sam_ssh_cache_rule spwr_cache[] = {
+	{ SAM_PWR_TC, SAM_RQST_PWR_CID_PSRC, SPWR_PSRC_CACHE_TTL },
+};
+
 static int spwr_subsys_init_unlocked(void)
 {
+	struct surface_sam_ssh_event_notifier *nf = &spwr_subsystem.notif;
 	int status;
 
-	status = surface_sam_ssh_set_event_handler(SAM_PWR_RQID, spwr_handle_event, NULL);
+	nf->rqid = SAM_PWR_RQID;
+	nf->tc = SAM_PWR_TC;
+	nf->priority = SURFACE_SAM_PRIORITY_NORMAL;
+	nf->cid_mask = NULL;
+	nf->handler = spwr_handle_event;
+	nf->delay = NULL;
+	nf->data = NULL;
+	nf->coalesce = SURFACE_SAM_SSH_EVENT_COALESCE_NONE;
+
+	status = surface_sam_ssh_cache_register(spwr_cache, ARRAY_SIZE(spwr_cache));
+	if (status) {
+		goto err_cache;
+	}
+
+	status = surface_sam_ssh_notifier_register(nf);
 	if (status) {
 		goto err_handler;
 	}
@@ -911,15 +1009,18 @@ static int spwr_subsys_init_unlocked(void)
 	return 0;
 
 err_source:
-	surface_sam_ssh_remove_event_handler(SAM_PWR_RQID);
+	surface_sam_ssh_notifier_unregister(&spwr_subsystem.notif);
 err_handler:
+	surface_sam_ssh_cache_unregister(spwr_cache);
+err_cache:
 	return status;
 }
 
 static int spwr_subsys_deinit_unlocked(void)
 {
 	surface_sam_ssh_disable_event_source(SAM_PWR_TC, 0x01, SAM_PWR_RQID);
-	surface_sam_ssh_remove_event_handler(SAM_PWR_RQID);
+	surface_sam_ssh_notifier_unregister(&spwr_subsystem.notif);
+	surface_sam_ssh_cache_unregister(spwr_cache);
 	return 0;
 }
 
@@ -327,6 +327,12 @@ static struct hid_device *sid_vhf_create_hid_device(struct platform_device *pdev
 	return hid;
 }
 
+static unsigned long sid_vhf_event_delay(struct surface_sam_ssh_event *event, void *data)
+{
+	// input events are latency-critical, handle them on the real-time thread
+	return SURFACE_SAM_SSH_EVENT_IMMEDIATE;
+}
+
 static int sid_vhf_event_handler(struct surface_sam_ssh_event *event, void *data)
 {
 	struct sid_vhf_evtctx *ctx = (struct sid_vhf_evtctx *)data;
@@ -378,10 +384,9 @@ static int surface_sam_sid_vhf_probe(struct platform_device *pdev)
 
 	platform_set_drvdata(pdev, drvdata);
 
-	status = surface_sam_ssh_set_event_handler(
-			SAM_EVENT_SID_VHF_RQID,
-			sid_vhf_event_handler,
-			&drvdata->event_ctx);
+	status = surface_sam_ssh_set_prioritized_event_handler(
+			SAM_EVENT_SID_VHF_RQID, sid_vhf_event_handler, sid_vhf_event_delay,
+			&drvdata->event_ctx, SURFACE_SAM_PRIORITY_HIGH);
 	if (status) {
 		goto err_event_handler;
 	}
@@ -5,19 +5,31 @@
 
 #include <asm/unaligned.h>
 #include <linux/acpi.h>
+#include <linux/atomic.h>
 #include <linux/completion.h>
 #include <linux/crc-ccitt.h>
 #include <linux/dmaengine.h>
 #include <linux/gpio/consumer.h>
 #include <linux/interrupt.h>
+#include <linux/jhash.h>
 #include <linux/jiffies.h>
 #include <linux/kernel.h>
 #include <linux/kfifo.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
+#include <linux/list.h>
+#include <linux/mempool.h>
+#include <linux/moduleparam.h>
 #include <linux/mutex.h>
 #include <linux/pm.h>
-#include <linux/refcount.h>
+#include <linux/rcupdate.h>
+#include <linux/random.h>
+#include <linux/rwsem.h>
+#include <linux/sched.h>
 #include <linux/serdev.h>
+#include <linux/slab.h>
 #include <linux/spinlock.h>
+#include <linux/wait.h>
 #include <linux/workqueue.h>
 
 #include "surface_sam_ssh.h"
@@ -63,9 +75,48 @@
 #define SSH_READ_TIMEOUT		msecs_to_jiffies(1000)
 #define SSH_NUM_RETRY			3
 
-#define SSH_WRITE_BUF_LEN		SSH_MAX_WRITE
-#define SSH_READ_BUF_LEN		512		// must be power of 2
-#define SSH_EVAL_BUF_LEN		SSH_MAX_WRITE	// also works for reading
+#define SSH_RTO_ACK_MIN_US		20000		// lower bound for ACK timeout
+#define SSH_RTO_RSP_MIN_US		200000		// lower bound for response RTO (statistics)
+#define SSH_RTO_MAX_US			1000000		// upper bound, initial timeout
+
+#define SSH_READ_BUF_LEN		128		// must be power of 2, ACK SEQs
+#define SSH_RING_BUF_LEN		1024		// must be power of 2
+#define SSH_EVAL_BUF_LEN		(SSH_MSG_LEN_CMD_BASE + U8_MAX)	// max. message
+
+#define SSH_EVENT_PLD_SMALL		32
+#define SSH_EVENT_PLD_LARGE		(U8_MAX - SSH_BYTELEN_CMDFRAME)
+#define SSH_EVENT_RESERVE_SMALL		32
+#define SSH_EVENT_RESERVE_LARGE		4
+
+#define SSH_ACK_BATCH_MAX		16	// max. ACKs per write
+
+#define SSH_EVENT_RT_RING_LEN		64	// must be power of 2
+
+#define SSH_EVENT_SEQ_WINDOW		8	// recent SEQs per source
+#define SSH_EVENT_DUP_TIMEOUT_MS	3000	// max. age of a retransmission
+
+#define SSH_EVENT_RATE_DEFAULT		500	// events per second and source
+#define SSH_EVENT_RATE_MAX		100000
+#define SSH_EVENT_BURST_DEFAULT		100
+#define SSH_EVENT_BURST_MAX		10000
+
+#define SSH_FRAME_RING_LEN		32	// must be power of 2
+#define SSH_DISPATCH_BUDGET		16	// max. frames per dispatcher run
+
+#define SSH_RQST_WINDOW_DEFAULT		3
+#define SSH_RQST_WINDOW_MAX		16
+#define SSH_RQST_HIGH_BURST		4	// high-prio. requests before a normal one
+
+#define SSH_CACHE_MAX_ENTRIES		64
+
+#define SSH_BREAKER_THRESHOLD_DEFAULT	3	// consecutive timeouts
+#define SSH_BREAKER_INTERVAL_DEFAULT	5000	// ms between probes
+#define SSH_BREAKER_INTERVAL_MIN	100
+
+#define SSH_WATCHDOG_INTERVAL_DEFAULT	2000	// ms between link checks
+#define SSH_WATCHDOG_TIMEOUTS		3	// request timeouts per check
+#define SSH_WATCHDOG_RX_ERRORS		8	// receive errors per check
+#define SSH_WATCHDOG_BACKOFF_MAX	5	// max. doublings of the interval
 
 #define SSH_FRAME_TYPE_CMD_NOACK	0x00	// request/event that does not to be ACKed
 #define SSH_FRAME_TYPE_CMD		0x80	// request/event
@@ -136,90 +187,448 @@ struct ssh_writer {
 	u8 *ptr;
 } __packed;
 
-enum ssh_receiver_state {
-	SSH_RCV_DISCARD,
-	SSH_RCV_CONTROL,
-	SSH_RCV_COMMAND,
+/*
+ * A complete and validated message, as extracted by the receiver.
+ */
+struct ssh_frame_slot {
+	ktime_t rx_time;
+	u16 len;
+	u8 data[SSH_EVAL_BUF_LEN];
 };
 
+/*
+ * The receiver works in two stages: The first one (ssh_receive_buf) only
+ * extracts valid messages from the incoming data into the frame ring. The
+ * second one (dispatcher tasklet) matches them to requests and dispatches
+ * events. The frame ring is single-producer single-consumer.
+ */
 struct ssh_receiver {
 	spinlock_t lock;
-	enum ssh_receiver_state state;
-	struct completion signal;
-	struct kfifo fifo;
+	struct kfifo fifo;		// SEQs of responses to be ACKed
+	unsigned int num_resync;	// number of resynchronizations
+	unsigned int num_discarded;	// bytes discarded while resynchronizing
+	unsigned int num_nak;		// RETRYs requested due to corruption
+	bool nak_pending;		// RETRY needs to be sent
 	struct {
-		bool pld;
-		u8 seq;
-		u16 rqid;
-	} expect;
+		struct ssh_frame_slot *slot;
+		unsigned int head;	// written by receiver only
+		unsigned int tail;	// written by dispatcher only
+		unsigned int num_extracted;
+		unsigned int num_dropped;
+		unsigned int num_dispatched;
+	} frames;
+	struct tasklet_struct dispatch;
+	ktime_t rx_time;		// time the current data has been received
+	struct {
+		u8 *ptr;		// ring storage, SSH_RING_BUF_LEN bytes
+		u8 *lin;		// linearized wrapped message
+		unsigned int head;	// write offset, free-running
+		unsigned int tail;	// read offset, free-running
+	} ring;
+};
+
+/*
+ * Request state flags. ACKED and NAKED are set by the receiver, RSPRCVD by
+ * the response-work. Any change is followed by scheduling the request work,
+ * which then decides on how to proceed. AWAITRSP is private to the request
+ * work and indicates that the response timeout has been armed.
+ */
+enum ssh_request_flags {
+	SSH_RQST_SF_ACKED_BIT,
+	SSH_RQST_SF_NAKED_BIT,
+	SSH_RQST_SF_RSPRCVD_BIT,
+	SSH_RQST_SF_AWAITRSP_BIT,
+};
+
+/*
+ * Round-trip time estimator, as used for TCP (RFC 6298). All values are in
+ * microseconds and protected by the rtl lock.
+ */
+struct ssh_rtt {
+	u32 srtt;		// smoothed round-trip time
+	u32 rttvar;		// round-trip time variation
+	u32 rto;		// resulting timeout
+	u32 min;		// lower bound for rto
+	u32 samples;
+};
+
+struct ssh_request {
+	struct list_head node;
+	struct sam_ssh_ec *ec;
+	unsigned long state;
+	u8  seq;
+	u16 rqid;
+	bool expect_rsp;
+	int status;
+	int try;
+	unsigned long timeout;
+	ktime_t tx_time;
+	ktime_t ack_time;
+	struct delayed_work work;
+	struct surface_sam_ssh_rqst rqst;
+	struct surface_sam_ssh_buf *result;
+	surface_sam_ssh_rqst_complete_fn complete;
+	void *complete_data;
+	u8 pld[SURFACE_SAM_SSH_MAX_RQST_PAYLOAD];
 	struct {
-		u16 cap;
-		u16 len;
-		u8 *ptr;
-	} eval_buf;
+		size_t len;
+		u8 data[SSH_MAX_WRITE];
+	} msg;
+};
+
+/*
+ * Requests are queued per class. Requests with SURFACE_SAM_PRIORITY_HIGH
+ * (e.g. HID reports) are sent ahead of normal ones.
+ */
+enum ssh_rqst_class {
+	SSH_RQST_CLASS_HIGH,
+	SSH_RQST_CLASS_NORMAL,
+	SSH_NUM_RQST_CLASSES,
+};
+
+enum ssh_breaker_state {
+	SSH_BREAKER_CLOSED,		// requests are sent
+	SSH_BREAKER_OPEN,		// requests fail fast, probe scheduled
+	SSH_BREAKER_PROBING,		// probe request in flight
+};
+
+/*
+ * Circuit breaker: After rqst_breaker_threshold consecutive timeouts, new
+ * requests fail immediately instead of waiting for their timeouts, until a
+ * periodic probe request is answered again. Any answer of the EC closes the
+ * breaker. Probes are only sent while the breaker is active, i.e. not while
+ * suspending or removing the device. Protected by the rtl lock.
+ */
+struct ssh_breaker {
+	enum ssh_breaker_state state;
+	bool active;
+	unsigned int num_failed;	// consecutive timeouts
+	unsigned int num_trip;
+	unsigned int num_rejected;
+	struct delayed_work probe;
+	u8 probe_buf[4];
+	struct surface_sam_ssh_buf probe_result;
+};
+
+/*
+ * Request transport layer: Keeps track of all requests currently in flight
+ * (i.e. sent, but not yet fully answered). Requests are matched to incoming
+ * ACKs via their control-frame SEQ and to incoming responses via their RQID.
+ * At most `window` requests can be pending at the same time, any further
+ * request is queued until a slot becomes available.
+ */
+struct ssh_rtl {
+	spinlock_t lock;
+	struct list_head queued[SSH_NUM_RQST_CLASSES];
+	struct list_head pending;
+	unsigned int num_queued;
+	unsigned int high_burst;	// high-prio. sent while normal waiting
+	unsigned int num_pending;
+	unsigned int window;
+	wait_queue_head_t waitq;
+	struct mutex tx_lock;
+	u8 *tx_buf;
+	struct workqueue_struct *queue;
+	struct work_struct tx_work;
+	struct work_struct ack_work;
+	struct ssh_rtt rtt_ack;		// transmission to ACK
+	struct ssh_rtt rtt_rsp;		// ACK to response, statistics only
+	atomic_t num_retransmit;
+	atomic_t num_timeout;
+	struct ssh_breaker breaker;
 };
 
+/*
+ * Event handlers are published via RCU, so that events can be dispatched
+ * without taking any lock. Handlers are only changed with the EC lock held
+ * exclusively. Each handler belongs to one notifier and is kept in the list
+ * of its RQID. Events are delivered to all handlers of the RQID matching
+ * their target category and command ID.
+ *
+ * Each handler has its own ordered workqueue, so that events of one source
+ * are handled in order and sources can't block each other. The queue is
+ * high-priority for handlers registered with SURFACE_SAM_PRIORITY_HIGH.
+ * Events in flight keep the handler alive via the pending counter.
+ *
+ * If coalescing is enabled, delayed events that have not been started yet
+ * are kept on the delayed list, so that new events with the same key can be
+ * merged into them.
+ *
+ * Immediate events are diverted to the workqueue if the real-time ring is
+ * full. To keep them in order, further immediate events follow them until
+ * all diverted ones have been handled, and diverted events wait for those
+ * still in the ring.
+ */
 struct ssh_event_handler {
+	struct list_head node;
+	u8 tc;
+	DECLARE_BITMAP(cid_mask, SURFACE_SAM_SSH_NUM_CIDS);
 	surface_sam_ssh_event_handler_fn handler;
 	surface_sam_ssh_event_handler_delay delay;
 	void *data;
+	struct workqueue_struct *queue;
+	bool high_pri;			// not subject to the default rate limit
+	atomic_t pending;
+	atomic_t rt_queued;		// immediate events in the real-time ring
+	atomic_t rt_diverted;		// immediate events on the workqueue
+	u8 coalesce;
+	spinlock_t lock;
+	struct list_head delayed;
+};
+
+/*
+ * Event work items are allocated from size-classed pools. The reserve of
+ * each pool guarantees that events can be received even if the (atomic)
+ * allocation from the slab cache fails.
+ */
+enum ssh_event_pool_class {
+	SSH_EVENT_POOL_SMALL,
+	SSH_EVENT_POOL_LARGE,
+	SSH_NUM_EVENT_POOLS,
+};
+
+struct ssh_event_pool {
+	struct kmem_cache *cache;
+	mempool_t *pool;
+	size_t pld_len;			// maximum payload length
+};
+
+/*
+ * Token bucket limiting the event rate of a single source (RQID). Rate and
+ * burst of zero select the module defaults. Tokens and counters are only
+ * updated by the dispatcher.
+ */
+struct ssh_event_bucket {
+	unsigned int rate;		// events per second
+	unsigned int burst;		// maximum number of tokens
+	u64 tokens;			// in units of 1/NSEC_PER_SEC tokens
+	ktime_t last;
+	unsigned int num_dropped;
+};
+
+/*
+ * Recently received events of a single source, used to detect frames the EC
+ * re-sent because our ACK was late. SEQs wrap around quickly, thus the
+ * payload CRC and receive time are compared as well. Only accessed by the
+ * dispatcher.
+ */
+struct ssh_event_seqwin {
+	struct {
+		u8 seq;
+		u16 crc;
+		ktime_t time;
+	} entry[SSH_EVENT_SEQ_WINDOW];
+	unsigned int next;
 };
 
 struct ssh_events {
-	spinlock_t lock;
 	struct workqueue_struct *queue_ack;
-	struct workqueue_struct *queue_evt;
-	struct ssh_event_handler handler[SAM_NUM_EVENT_TYPES];
+	struct workqueue_struct *queue_evt;	// unhandled events only
+	wait_queue_head_t waitq;
+
+	/*
+	 * Immediate events are handed to a real-time thread, if enabled. The
+	 * ring is single-producer (receiver) single-consumer (thread).
+	 */
+	struct {
+		struct task_struct *thread;
+		struct ssh_event_work *buf[SSH_EVENT_RT_RING_LEN];
+		unsigned int head;		// written by receiver only
+		unsigned int tail;		// written by thread only
+	} rt;
+
+	struct ssh_event_pool pool[SSH_NUM_EVENT_POOLS];
+	struct list_head handlers[SAM_NUM_EVENT_TYPES];
+	struct surface_sam_ssh_event_notifier *legacy[SAM_NUM_EVENT_TYPES];
+	struct ssh_event_bucket bucket[SAM_NUM_EVENT_TYPES];
+	struct ssh_event_seqwin seen[SAM_NUM_EVENT_TYPES];
+	unsigned int num_duplicate;
+	atomic_t num_merged;
+
+	/*
+	 * Event sources are enabled on the EC once, when their first user
+	 * enables them, and disabled when their last user disables them.
+	 */
+	struct mutex source_lock;
+	struct {
+		unsigned int refcount;
+		u8 tc;
+		u8 unknown;
+	} source[SAM_NUM_EVENT_TYPES];
 };
 
-struct sam_ssh_ec {
+/*
+ * Shared requests currently in flight. Identical shared requests submitted
+ * while one is in flight wait for it and receive a copy of its response.
+ */
+struct ssh_flights {
+	struct mutex lock;
+	struct list_head list;
+	atomic_t num_shared;		// round-trips saved
+};
+
+/*
+ * Response cache for idempotent requests. Drivers opt commands in via rule
+ * tables specifying their TTL. Entries are keyed by (tc, cid, iid, payload)
+ * and compared by hash first. Invalidation bumps the generation, so that
+ * responses to requests sent before the invalidation are not cached.
+ *
+ * The commands of all registered rules are also marked in the (tc, cid)
+ * bitmap, so that requests for any other command can skip the cache without
+ * taking its lock. The bitmap is only changed with the lock held.
+ */
+#define SSH_CACHE_KEY(tc, cid)		(((tc) << 8) | (cid))
+
+struct ssh_cache {
 	struct mutex lock;
+	DECLARE_BITMAP(cached, SSH_CACHE_KEY(U8_MAX, U8_MAX) + 1);
+	struct list_head tables;
+	struct list_head entries;	// oldest first
+	unsigned int num_entries;
+	unsigned int generation;
+	unsigned int num_hit;
+	unsigned int num_miss;
+	unsigned int num_invalidated;
+};
+
+/*
+ * Link health at one point in time, as sampled by the watchdog.
+ */
+struct ssh_link_sample {
+	unsigned int timeouts;		// requests timed out
+	unsigned int rx_errors;		// resynchronizations and RETRYs
+	unsigned int pending;		// requests in flight
+	ktime_t rx_time;		// last time data has been received
+};
+
+/*
+ * Link watchdog: Periodically compares link health to the previous check
+ * and re-initializes the link if it appears to be wedged, i.e. on repeated
+ * request timeouts, bursts of receive errors, or if nothing has been
+ * received while requests were pending. Only accessed by the watchdog work.
+ * As recovery may block for several request timeouts, the watchdog has its
+ * own workqueue.
+ */
+struct ssh_watchdog {
+	struct workqueue_struct *queue;
+	struct delayed_work work;
+	unsigned long interval;		// in jiffies, 0 if disabled
+	struct ssh_link_sample last;
+	unsigned int backoff;		// consecutive failed recoveries
+	unsigned int num_recovered;
+	unsigned int num_failed;
+};
+
+struct sam_ssh_ec {
+	struct rw_semaphore lock;
 	enum ssh_ec_state state;
 	struct serdev_device *serdev;
 	struct ssh_counters counter;
-	struct ssh_writer writer;
+	struct ssh_rtl rtl;
 	struct ssh_receiver receiver;
 	struct ssh_events events;
+	struct ssh_flights flights;
+	struct ssh_cache cache;
+	struct ssh_watchdog watchdog;
 	int irq;
 	bool irq_wakeup_enabled;
 };
 
-struct ssh_fifo_packet {
-	u8 type;	// packet type (ACK/RETRY/CMD)
-	u8 seq;
-	u8 len;
-};
-
 struct ssh_event_work {
-	refcount_t refcount;
+	mempool_t *pool;
+	size_t pld_cap;			// payload capacity of the pool
 	struct sam_ssh_ec *ec;
-	struct work_struct work_ack;
+	struct ssh_event_handler *handler;
+	struct list_head node;		// handler delayed list, if coalescing
+	bool rt_queued;			// in the real-time ring
+	bool rt_diverted;		// immediate, but on the workqueue
 	struct delayed_work work_evt;
 	struct surface_sam_ssh_event event;
-	u8 seq;
 };
 
 
+static unsigned int rqst_window = SSH_RQST_WINDOW_DEFAULT;
+module_param(rqst_window, uint, 0444);
+MODULE_PARM_DESC(rqst_window, "maximum number of requests in flight [1-16, default: 3]");
+
+static bool event_rt_thread = true;
+module_param(event_rt_thread, bool, 0444);
+MODULE_PARM_DESC(event_rt_thread, "handle immediate events on a real-time thread instead of in the receiver [default: Y]");
+
+static unsigned int event_rate_limit = SSH_EVENT_RATE_DEFAULT;
+module_param(event_rate_limit, uint, 0644);
+MODULE_PARM_DESC(event_rate_limit, "default maximum number of events per second and source, 0 for no limit, not applied to high-priority handlers [default: 500]");
+
+static unsigned int event_rate_burst = SSH_EVENT_BURST_DEFAULT;
+module_param(event_rate_burst, uint, 0644);
+MODULE_PARM_DESC(event_rate_burst, "default number of events per source allowed in a burst [default: 100]");
+
+static unsigned int rqst_breaker_threshold = SSH_BREAKER_THRESHOLD_DEFAULT;
+module_param(rqst_breaker_threshold, uint, 0644);
+MODULE_PARM_DESC(rqst_breaker_threshold, "consecutive request timeouts after which requests fail fast, 0 to disable [default: 3]");
+
+static unsigned int rqst_breaker_interval = SSH_BREAKER_INTERVAL_DEFAULT;
+module_param(rqst_breaker_interval, uint, 0644);
+MODULE_PARM_DESC(rqst_breaker_interval, "milliseconds between probes while requests fail fast [default: 5000]");
+
+static unsigned int link_watchdog_interval = SSH_WATCHDOG_INTERVAL_DEFAULT;
+module_param(link_watchdog_interval, uint, 0444);
+MODULE_PARM_DESC(link_watchdog_interval, "milliseconds between link health checks, 0 to disable the watchdog [default: 2000]");
+
+
 static struct sam_ssh_ec ssh_ec = {
-	.lock   = __MUTEX_INITIALIZER(ssh_ec.lock),
+	.lock   = __RWSEM_INITIALIZER(ssh_ec.lock),
 	.state  = SSH_EC_UNINITIALIZED,
 	.serdev = NULL,
 	.counter = {
 		.seq  = 0,
 		.rqid = 0,
 	},
-	.writer = {
-		.data = NULL,
-		.ptr  = NULL,
+	.rtl = {
+		.lock = __SPIN_LOCK_UNLOCKED(),
+		.queued = {
+			[SSH_RQST_CLASS_HIGH] = LIST_HEAD_INIT(ssh_ec.rtl.queued[SSH_RQST_CLASS_HIGH]),
+			[SSH_RQST_CLASS_NORMAL] = LIST_HEAD_INIT(ssh_ec.rtl.queued[SSH_RQST_CLASS_NORMAL]),
+		},
+		.pending = LIST_HEAD_INIT(ssh_ec.rtl.pending),
+		.num_queued = 0,
+		.num_pending = 0,
+		.window = SSH_RQST_WINDOW_DEFAULT,
+		.waitq = __WAIT_QUEUE_HEAD_INITIALIZER(ssh_ec.rtl.waitq),
+		.tx_lock = __MUTEX_INITIALIZER(ssh_ec.rtl.tx_lock),
+		.rtt_ack = {
+			.rto = SSH_RTO_MAX_US,
+			.min = SSH_RTO_ACK_MIN_US,
+		},
+		.rtt_rsp = {
+			.rto = SSH_RTO_MAX_US,
+			.min = SSH_RTO_RSP_MIN_US,
+		},
+		.num_retransmit = ATOMIC_INIT(0),
+		.num_timeout = ATOMIC_INIT(0),
+		.breaker = {
+			.state = SSH_BREAKER_CLOSED,
+			.active = false,
+		},
 	},
 	.receiver = {
 		.lock = __SPIN_LOCK_UNLOCKED(),
-		.state = SSH_RCV_DISCARD,
-		.expect = {},
 	},
 	.events = {
-		.lock = __SPIN_LOCK_UNLOCKED(),
-		.handler = {},
+		.waitq = __WAIT_QUEUE_HEAD_INITIALIZER(ssh_ec.events.waitq),
+		.legacy = {},
+		.num_merged = ATOMIC_INIT(0),
+		.source_lock = __MUTEX_INITIALIZER(ssh_ec.events.source_lock),
+	},
+	.flights = {
+		.lock = __MUTEX_INITIALIZER(ssh_ec.flights.lock),
+		.list = LIST_HEAD_INIT(ssh_ec.flights.list),
+		.num_shared = ATOMIC_INIT(0),
+	},
+	.cache = {
+		.lock = __MUTEX_INITIALIZER(ssh_ec.cache.lock),
+		.tables = LIST_HEAD_INIT(ssh_ec.cache.tables),
+		.entries = LIST_HEAD_INIT(ssh_ec.cache.entries),
 	},
 	.irq = -1,
 };
@@ -229,13 +638,26 @@ inline static struct sam_ssh_ec *surface_sam_ssh_acquire(void)
 {
 	struct sam_ssh_ec *ec = &ssh_ec;
 
-	mutex_lock(&ec->lock);
+	down_write(&ec->lock);
 	return ec;
 }
 
 inline static void surface_sam_ssh_release(struct sam_ssh_ec *ec)
 {
-	mutex_unlock(&ec->lock);
+	up_write(&ec->lock);
+}
+
+inline static struct sam_ssh_ec *surface_sam_ssh_acquire_shared(void)
+{
+	struct sam_ssh_ec *ec = &ssh_ec;
+
+	down_read(&ec->lock);
+	return ec;
+}
+
+inline static void surface_sam_ssh_release_shared(struct sam_ssh_ec *ec)
+{
+	up_read(&ec->lock);
 }
 
 inline static struct sam_ssh_ec *surface_sam_ssh_acquire_init(void)
@@ -250,6 +672,18 @@ inline static struct sam_ssh_ec *surface_sam_ssh_acquire_init(void)
 	return ec;
 }
 
+inline static struct sam_ssh_ec *surface_sam_ssh_acquire_shared_init(void)
+{
+	struct sam_ssh_ec *ec = surface_sam_ssh_acquire_shared();
+
+	if (ec->state == SSH_EC_UNINITIALIZED) {
+		surface_sam_ssh_release_shared(ec);
+		return NULL;
+	}
+
+	return ec;
+}
+
 int surface_sam_ssh_consumer_register(struct device *consumer)
 {
 	u32 flags = DL_FLAG_PM_RUNTIME | DL_FLAG_AUTOREMOVE_CONSUMER;
@@ -281,7 +715,18 @@ inline static bool sam_rqid_is_event(u16 rqid) {
 	return rqid != 0 && (rqid | mask) == mask;
 }
 
-int surface_sam_ssh_enable_event_source(u8 tc, u8 unknown, u16 rqid)
+static int surface_sam_ssh_rqst_unlocked(struct sam_ssh_ec *ec,
+					 const struct surface_sam_ssh_rqst *rqst,
+					 struct surface_sam_ssh_buf *result);
+static int ssh_breaker_admit(struct sam_ssh_ec *ec);
+
+/*
+ * Event sources are changed with the EC lock held (shared) and the source
+ * lock taken inside of it, i.e. in the same order as on removal. Requests
+ * are thus sent via surface_sam_ssh_rqst_unlocked.
+ */
+static int __surface_sam_ssh_enable_event_source(struct sam_ssh_ec *ec,
+						 u8 tc, u8 unknown, u16 rqid)
 {
 	u8 pld[4] = { tc, unknown, rqid & 0xff, rqid >> 8 };
 	u8 buf[1] = { 0x00 };
@@ -309,7 +754,12 @@ int surface_sam_ssh_enable_event_source(u8 tc, u8 unknown, u16 rqid)
 		return -EINVAL;
 	}
 
-	status = surface_sam_ssh_rqst(&rqst, &result);
+	status = ssh_breaker_admit(ec);
+	if (status) {
+		return status;
+	}
+
+	status = surface_sam_ssh_rqst_unlocked(ec, &rqst, &result);
 
 	if (buf[0] != 0x00) {
 		printk(KERN_WARNING SSH_RQST_TAG_FULL
@@ -320,9 +770,9 @@ int surface_sam_ssh_enable_event_source(u8 tc, u8 unknown, u16 rqid)
 	return status;
 
 }
-EXPORT_SYMBOL_GPL(surface_sam_ssh_enable_event_source);
 
-int surface_sam_ssh_disable_event_source(u8 tc, u8 unknown, u16 rqid)
+static int __surface_sam_ssh_disable_event_source(struct sam_ssh_ec *ec,
+						  u8 tc, u8 unknown, u16 rqid)
 {
 	u8 pld[4] = { tc, unknown, rqid & 0xff, rqid >> 8 };
 	u8 buf[1] = { 0x00 };
@@ -350,7 +800,12 @@ int surface_sam_ssh_disable_event_source(u8 tc, u8 unknown, u16 rqid)
 		return -EINVAL;
 	}
 
-	status = surface_sam_ssh_rqst(&rqst, &result);
+	status = ssh_breaker_admit(ec);
+	if (status) {
+		return status;
+	}
+
+	status = surface_sam_ssh_rqst_unlocked(ec, &rqst, &result);
 
 	if (buf[0] != 0x00) {
 		printk(KERN_WARNING SSH_RQST_TAG_FULL
@@ -360,156 +815,594 @@ int surface_sam_ssh_disable_event_source(u8 tc, u8 unknown, u16 rqid)
 
 	return status;
 }
-EXPORT_SYMBOL_GPL(surface_sam_ssh_disable_event_source);
 
-static unsigned long sam_event_default_delay(struct surface_sam_ssh_event *event, void *data)
+static struct sam_ssh_ec *ssh_event_source_acquire(void)
 {
-	return event->pri == SURFACE_SAM_PRIORITY_HIGH ? SURFACE_SAM_SSH_EVENT_IMMEDIATE : 0;
+	struct sam_ssh_ec *ec;
+
+	ec = surface_sam_ssh_acquire_shared_init();
+	if (!ec) {
+		printk(KERN_WARNING SSH_RQST_TAG_FULL "embedded controller is uninitialized\n");
+		return ERR_PTR(-ENXIO);
+	}
+
+	if (ec->state == SSH_EC_SUSPENDED) {
+		dev_warn(&ec->serdev->dev, SSH_RQST_TAG "embedded controller is suspended\n");
+
+		surface_sam_ssh_release_shared(ec);
+		return ERR_PTR(-EPERM);
+	}
+
+	mutex_lock(&ec->events.source_lock);
+	return ec;
 }
 
-int surface_sam_ssh_set_delayed_event_handler(
-		u16 rqid, surface_sam_ssh_event_handler_fn fn,
-		surface_sam_ssh_event_handler_delay delay,
-		void *data)
+static void ssh_event_source_release(struct sam_ssh_ec *ec)
+{
+	mutex_unlock(&ec->events.source_lock);
+	surface_sam_ssh_release_shared(ec);
+}
+
+int surface_sam_ssh_enable_event_source(u8 tc, u8 unknown, u16 rqid)
 {
 	struct sam_ssh_ec *ec;
-	unsigned long flags;
+	int status = 0;
 
 	if (!sam_rqid_is_event(rqid)) {
 		return -EINVAL;
 	}
 
-	ec = surface_sam_ssh_acquire_init();
-	if (!ec) {
-		return -ENXIO;
-	}
-
-	if (!delay) {
-		delay = sam_event_default_delay;
-	}
-
-	spin_lock_irqsave(&ec->events.lock, flags);
-	// check if we already have a handler
-	if (ec->events.handler[rqid - 1].handler) {
-		spin_unlock_irqrestore(&ec->events.lock, flags);
-		return -EINVAL;
+	ec = ssh_event_source_acquire();
+	if (IS_ERR(ec)) {
+		return PTR_ERR(ec);
 	}
 
 	// 0 is not a valid event RQID
-	ec->events.handler[rqid - 1].handler = fn;
-	ec->events.handler[rqid - 1].delay = delay;
-	ec->events.handler[rqid - 1].data = data;
+	if (ec->events.source[rqid - 1].refcount == 0) {
+		status = __surface_sam_ssh_enable_event_source(ec, tc, unknown, rqid);
+		if (!status) {
+			ec->events.source[rqid - 1].tc = tc;
+			ec->events.source[rqid - 1].unknown = unknown;
+		}
+	} else if (ec->events.source[rqid - 1].tc != tc) {
+		printk(KERN_WARNING SSH_RQST_TAG_FULL
+		       "event source %04x already enabled for tc 0x%02x\n",
+		       rqid, ec->events.source[rqid - 1].tc);
+		status = -EINVAL;
+	}
 
-	spin_unlock_irqrestore(&ec->events.lock, flags);
-	surface_sam_ssh_release(ec);
+	if (!status)
+		ec->events.source[rqid - 1].refcount += 1;
 
-	return 0;
+	ssh_event_source_release(ec);
+	return status;
 }
-EXPORT_SYMBOL_GPL(surface_sam_ssh_set_delayed_event_handler);
+EXPORT_SYMBOL_GPL(surface_sam_ssh_enable_event_source);
 
-int surface_sam_ssh_remove_event_handler(u16 rqid)
+int surface_sam_ssh_disable_event_source(u8 tc, u8 unknown, u16 rqid)
 {
 	struct sam_ssh_ec *ec;
-	unsigned long flags;
+	int status = 0;
 
 	if (!sam_rqid_is_event(rqid)) {
 		return -EINVAL;
 	}
 
-	ec = surface_sam_ssh_acquire_init();
-	if (!ec) {
-		return -ENXIO;
+	ec = ssh_event_source_acquire();
+	if (IS_ERR(ec)) {
+		return PTR_ERR(ec);
 	}
 
-	spin_lock_irqsave(&ec->events.lock, flags);
-
 	// 0 is not a valid event RQID
-	ec->events.handler[rqid - 1].handler = NULL;
-	ec->events.handler[rqid - 1].delay = NULL;
-	ec->events.handler[rqid - 1].data = NULL;
-
-	spin_unlock_irqrestore(&ec->events.lock, flags);
-	surface_sam_ssh_release(ec);
+	if (ec->events.source[rqid - 1].refcount == 0 || ec->events.source[rqid - 1].tc != tc) {
+		ssh_event_source_release(ec);
+		return -EINVAL;
+	}
 
-	/*
-	 * Make sure that the handler is not in use any more after we've
-	 * removed it.
-	 */
-	flush_workqueue(ec->events.queue_evt);
+	ec->events.source[rqid - 1].refcount -= 1;
+	if (ec->events.source[rqid - 1].refcount == 0)
+		status = __surface_sam_ssh_disable_event_source(ec, tc, unknown, rqid);
 
-	return 0;
+	ssh_event_source_release(ec);
+	return status;
 }
-EXPORT_SYMBOL_GPL(surface_sam_ssh_remove_event_handler);
-
+EXPORT_SYMBOL_GPL(surface_sam_ssh_disable_event_source);
 
-inline static u16 ssh_crc(const u8 *buf, size_t size)
+static unsigned long sam_event_default_delay(struct surface_sam_ssh_event *event, void *data)
 {
-	return crc_ccitt_false(0xffff, buf, size);
+	return event->pri == SURFACE_SAM_PRIORITY_HIGH ? SURFACE_SAM_SSH_EVENT_IMMEDIATE : 0;
 }
 
-inline static void ssh_write_u16(struct ssh_writer *writer, u16 in)
+static struct ssh_event_handler *ssh_event_handler_create(
+		const struct surface_sam_ssh_event_notifier *nf)
 {
-	put_unaligned_le16(in, writer->ptr);
-	writer->ptr += 2;
+	struct ssh_event_handler *h;
+
+	h = kzalloc(sizeof(*h), GFP_KERNEL);
+	if (!h) {
+		return NULL;
+	}
+
+	h->tc = nf->tc;
+	h->handler = nf->handler;
+	h->delay = nf->delay ? nf->delay : sam_event_default_delay;
+	h->data = nf->data;
+	h->high_pri = nf->priority == SURFACE_SAM_PRIORITY_HIGH;
+	atomic_set(&h->pending, 0);
+	atomic_set(&h->rt_queued, 0);
+	atomic_set(&h->rt_diverted, 0);
+	h->coalesce = nf->coalesce;
+	spin_lock_init(&h->lock);
+	INIT_LIST_HEAD(&h->delayed);
+
+	if (nf->cid_mask) {
+		bitmap_copy(h->cid_mask, nf->cid_mask, SURFACE_SAM_SSH_NUM_CIDS);
+	} else {
+		bitmap_fill(h->cid_mask, SURFACE_SAM_SSH_NUM_CIDS);
+	}
+
+	h->queue = alloc_ordered_workqueue("surface_sh_evtq_%02x",
+			nf->priority == SURFACE_SAM_PRIORITY_HIGH ? WQ_HIGHPRI : 0,
+			nf->rqid);
+	if (!h->queue) {
+		kfree(h);
+		return NULL;
+	}
+
+	return h;
 }
 
-inline static void ssh_write_crc(struct ssh_writer *writer,
-				 const u8 *buf, size_t size)
+/*
+ * Wait for all events currently handled by the (already unpublished)
+ * handler and free it afterwards.
+ */
+static void ssh_event_handler_free(struct sam_ssh_ec *ec, struct ssh_event_handler *h)
 {
-	ssh_write_u16(writer, ssh_crc(buf, size));
+	if (!h)
+		return;
+
+	wait_event(ec->events.waitq, atomic_read(&h->pending) == 0);
+	destroy_workqueue(h->queue);
+	kfree(h);
 }
 
-inline static void ssh_write_syn(struct ssh_writer *writer)
+/*
+ * Add the handler of the notifier to the list of its RQID. Must be called
+ * with the EC lock held exclusively.
+ */
+static void ssh_event_handler_publish(struct sam_ssh_ec *ec,
+		struct surface_sam_ssh_event_notifier *nf,
+		struct ssh_event_handler *h)
 {
-	u8 *w = writer->ptr;
+	// 0 is not a valid event RQID
+	struct list_head *handlers = &ec->events.handlers[nf->rqid - 1];
 
-	*w++ = 0xaa;
-	*w++ = 0x55;
+	// the first handler of a source starts out with the default rate limit
+	if (list_empty(handlers)) {
+		WRITE_ONCE(ec->events.bucket[nf->rqid - 1].rate, 0);
+		WRITE_ONCE(ec->events.bucket[nf->rqid - 1].burst, 0);
+	}
 
-	writer->ptr = w;
+	list_add_tail_rcu(&h->node, handlers);
+	nf->priv = h;
 }
 
-inline static void ssh_write_ter(struct ssh_writer *writer)
+/*
+ * Remove the handler of the notifier from the list of its RQID. Must be
+ * called with the EC lock held exclusively. The handler may only be freed
+ * after an RCU grace period.
+ */
+static struct ssh_event_handler *ssh_event_handler_unpublish(
+		struct surface_sam_ssh_event_notifier *nf)
 {
-	u8 *w = writer->ptr;
+	struct ssh_event_handler *h = nf->priv;
 
-	*w++ = 0xff;
-	*w++ = 0xff;
+	if (h) {
+		list_del_rcu(&h->node);
+		nf->priv = NULL;
+	}
 
-	writer->ptr = w;
+	return h;
 }
 
-inline static void ssh_write_buf(struct ssh_writer *writer,
-				 u8 *in, size_t len)
+int surface_sam_ssh_notifier_register(struct surface_sam_ssh_event_notifier *nf)
 {
-	writer->ptr = memcpy(writer->ptr, in, len) + len;
-}
+	struct ssh_event_handler *h;
+	struct sam_ssh_ec *ec;
 
-inline static void ssh_write_hdr(struct ssh_writer *writer,
-				 const struct surface_sam_ssh_rqst *rqst,
-				 struct sam_ssh_ec *ec)
-{
-	struct ssh_frame_ctrl *hdr = (struct ssh_frame_ctrl *)writer->ptr;
+	if (!sam_rqid_is_event(nf->rqid) || !nf->handler) {
+		return -EINVAL;
+	}
+
+	if (nf->coalesce > SURFACE_SAM_SSH_EVENT_COALESCE_EXTEND) {
+		return -EINVAL;
+	}
+
+	h = ssh_event_handler_create(nf);
+	if (!h) {
+		return -ENOMEM;
+	}
+
+	ec = surface_sam_ssh_acquire_init();
+	if (!ec) {
+		ssh_event_handler_free(&ssh_ec, h);
+		return -ENXIO;
+	}
+
+	ssh_event_handler_publish(ec, nf, h);
+	surface_sam_ssh_release(ec);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(surface_sam_ssh_notifier_register);
+
+int surface_sam_ssh_notifier_unregister(struct surface_sam_ssh_event_notifier *nf)
+{
+	struct ssh_event_handler *h;
+	struct sam_ssh_ec *ec;
+
+	ec = surface_sam_ssh_acquire_init();
+	if (!ec) {
+		return -ENXIO;
+	}
+
+	h = ssh_event_handler_unpublish(nf);
+	surface_sam_ssh_release(ec);
+
+	if (!h) {
+		return -EINVAL;
+	}
+
+	/*
+	 * Make sure that the handler is not in use any more after we've
+	 * removed it. Events are dispatched to the handler in a read-side
+	 * critical section, thus after this, its pending counter covers all
+	 * events that still need to be handled.
+	 */
+	synchronize_rcu();
+	ssh_event_handler_free(ec, h);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(surface_sam_ssh_notifier_unregister);
+
+/*
+ * Handlers registered via the old interface receive all events of their
+ * RQID. They are backed by a notifier allocated here, of which there can
+ * only be one per RQID.
+ */
+int surface_sam_ssh_set_prioritized_event_handler(
+		u16 rqid, surface_sam_ssh_event_handler_fn fn,
+		surface_sam_ssh_event_handler_delay delay,
+		void *data, u8 priority)
+{
+	struct surface_sam_ssh_event_notifier *nf;
+	struct ssh_event_handler *h;
+	struct sam_ssh_ec *ec;
+	int status;
+
+	if (!sam_rqid_is_event(rqid)) {
+		return -EINVAL;
+	}
+
+	nf = kzalloc(sizeof(*nf), GFP_KERNEL);
+	if (!nf) {
+		return -ENOMEM;
+	}
+
+	nf->rqid = rqid;
+	nf->tc = SURFACE_SAM_SSH_EVENT_TC_ANY;
+	nf->priority = priority;
+	nf->cid_mask = NULL;
+	nf->handler = fn;
+	nf->delay = delay;
+	nf->data = data;
+	nf->coalesce = SURFACE_SAM_SSH_EVENT_COALESCE_NONE;
+
+	h = ssh_event_handler_create(nf);
+	if (!h) {
+		kfree(nf);
+		return -ENOMEM;
+	}
+
+	ec = surface_sam_ssh_acquire_init();
+	if (!ec) {
+		status = -ENXIO;
+		goto err;
+	}
+
+	// check if we already have a handler, 0 is not a valid event RQID
+	if (ec->events.legacy[rqid - 1]) {
+		surface_sam_ssh_release(ec);
+		status = -EINVAL;
+		goto err;
+	}
+
+	ec->events.legacy[rqid - 1] = nf;
+	ssh_event_handler_publish(ec, nf, h);
+	surface_sam_ssh_release(ec);
+
+	return 0;
+
+err:
+	ssh_event_handler_free(&ssh_ec, h);
+	kfree(nf);
+	return status;
+}
+EXPORT_SYMBOL_GPL(surface_sam_ssh_set_prioritized_event_handler);
+
+int surface_sam_ssh_remove_event_handler(u16 rqid)
+{
+	struct surface_sam_ssh_event_notifier *nf;
+	struct ssh_event_handler *h = NULL;
+	struct sam_ssh_ec *ec;
+
+	if (!sam_rqid_is_event(rqid)) {
+		return -EINVAL;
+	}
+
+	ec = surface_sam_ssh_acquire_init();
+	if (!ec) {
+		return -ENXIO;
+	}
+
+	// 0 is not a valid event RQID
+	nf = ec->events.legacy[rqid - 1];
+	ec->events.legacy[rqid - 1] = NULL;
+	if (nf)
+		h = ssh_event_handler_unpublish(nf);
+
+	surface_sam_ssh_release(ec);
+
+	// see surface_sam_ssh_notifier_unregister
+	synchronize_rcu();
+	ssh_event_handler_free(ec, h);
+	kfree(nf);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(surface_sam_ssh_remove_event_handler);
+
+int surface_sam_ssh_set_event_coalescing(u16 rqid, u8 mode)
+{
+	struct ssh_event_handler *h;
+	struct sam_ssh_ec *ec;
+	int status = 0;
+
+	if (!sam_rqid_is_event(rqid)) {
+		return -EINVAL;
+	}
+
+	if (mode > SURFACE_SAM_SSH_EVENT_COALESCE_EXTEND) {
+		return -EINVAL;
+	}
+
+	ec = surface_sam_ssh_acquire_init();
+	if (!ec) {
+		return -ENXIO;
+	}
+
+	// 0 is not a valid event RQID
+	h = ec->events.legacy[rqid - 1] ? ec->events.legacy[rqid - 1]->priv : NULL;
+	if (h) {
+		WRITE_ONCE(h->coalesce, mode);
+	} else {
+		status = -EINVAL;
+	}
+
+	surface_sam_ssh_release(ec);
+	return status;
+}
+EXPORT_SYMBOL_GPL(surface_sam_ssh_set_event_coalescing);
+
+int surface_sam_ssh_set_event_ratelimit(u16 rqid, unsigned int rate, unsigned int burst)
+{
+	struct sam_ssh_ec *ec;
+
+	if (!sam_rqid_is_event(rqid)) {
+		return -EINVAL;
+	}
+
+	if (rate > SSH_EVENT_RATE_MAX || burst > SSH_EVENT_BURST_MAX) {
+		return -EINVAL;
+	}
+
+	ec = surface_sam_ssh_acquire_init();
+	if (!ec) {
+		return -ENXIO;
+	}
+
+	// 0 is not a valid event RQID
+	WRITE_ONCE(ec->events.bucket[rqid - 1].rate, rate);
+	WRITE_ONCE(ec->events.bucket[rqid - 1].burst, burst);
+
+	surface_sam_ssh_release(ec);
+	return 0;
+}
+EXPORT_SYMBOL_GPL(surface_sam_ssh_set_event_ratelimit);
+
+
+/*
+ * CRC-CCITT (polynomial 0x1021, MSB first, seed 0xffff), computed four bytes
+ * at a time (slice-by-4). Table k contains the CRC contribution of a byte
+ * followed by k zero-bytes. Equivalent to crc_ccitt_false(0xffff, ...).
+ */
+static u16 ssh_crc_table[4][256] __read_mostly;
+
+static void ssh_crc_init(void)
+{
+	unsigned int i, k;
+	u16 crc;
+
+	for (i = 0; i < 256; i++) {
+		crc = i << 8;
+
+		for (k = 0; k < 8; k++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+
+		ssh_crc_table[0][i] = crc;
+	}
+
+	for (k = 1; k < ARRAY_SIZE(ssh_crc_table); k++) {
+		for (i = 0; i < 256; i++) {
+			crc = ssh_crc_table[k - 1][i];
+			ssh_crc_table[k][i] = (crc << 8) ^ ssh_crc_table[0][crc >> 8];
+		}
+	}
+}
+
+inline static u16 ssh_crc_byte(u16 crc, u8 b)
+{
+	return (crc << 8) ^ ssh_crc_table[0][(crc >> 8) ^ b];
+}
+
+inline static u16 ssh_crc_word(u16 crc, const u8 *b)
+{
+	return ssh_crc_table[3][(crc >> 8) ^ b[0]]
+	     ^ ssh_crc_table[2][(crc & 0xff) ^ b[1]]
+	     ^ ssh_crc_table[1][b[2]]
+	     ^ ssh_crc_table[0][b[3]];
+}
+
+static u16 ssh_crc_update(u16 crc, const u8 *buf, size_t size)
+{
+	for (; size >= 4; size -= 4, buf += 4)
+		crc = ssh_crc_word(crc, buf);
+
+	for (; size; size--)
+		crc = ssh_crc_byte(crc, *buf++);
+
+	return crc;
+}
+
+/*
+ * Copy the buffer and update the CRC in a single pass, so that outgoing
+ * payloads need not be walked twice.
+ */
+static u16 ssh_crc_copy(u16 crc, u8 *dst, const u8 *src, size_t size)
+{
+	for (; size >= 4; size -= 4, src += 4, dst += 4) {
+		memcpy(dst, src, 4);
+		crc = ssh_crc_word(crc, dst);
+	}
+
+	for (; size; size--) {
+		*dst = *src++;
+		crc = ssh_crc_byte(crc, *dst++);
+	}
+
+	return crc;
+}
+
+inline static u16 ssh_crc(const u8 *buf, size_t size)
+{
+	return ssh_crc_update(0xffff, buf, size);
+}
+
+#ifdef SSH_CRC_SELFTEST
+/*
+ * Verify the CRC implementation against crc_ccitt_false() and compare the
+ * run-time of both. Enabled by building with -DSSH_CRC_SELFTEST.
+ */
+static void ssh_crc_selftest(struct device *dev)
+{
+	static u8 buf[SSH_EVAL_BUF_LEN];
+	const unsigned int iterations = 10000;
+	ktime_t start, t_ref, t_ssh;
+	unsigned int i, len;
+	u16 acc = 0;
+
+	get_random_bytes(buf, sizeof(buf));
+
+	for (len = 0; len <= sizeof(buf); len++) {
+		if (ssh_crc(buf, len) != crc_ccitt_false(0xffff, buf, len)) {
+			dev_err(dev, "crc selftest: mismatch (len: %u)\n", len);
+			return;
+		}
+	}
+
+	start = ktime_get();
+	for (i = 0; i < iterations; i++)
+		acc ^= crc_ccitt_false(0xffff, buf, sizeof(buf));
+	t_ref = ktime_sub(ktime_get(), start);
+
+	start = ktime_get();
+	for (i = 0; i < iterations; i++)
+		acc ^= ssh_crc(buf, sizeof(buf));
+	t_ssh = ktime_sub(ktime_get(), start);
+
+	dev_info(dev, "crc selftest: %u x %zu bytes: crc_ccitt_false: %lld us, "
+		 "ssh_crc: %lld us (0x%04x)\n", iterations, sizeof(buf),
+		 ktime_to_us(t_ref), ktime_to_us(t_ssh), acc);
+}
+#else
+inline static void ssh_crc_selftest(struct device *dev)
+{
+}
+#endif /* SSH_CRC_SELFTEST */
+
+inline static void ssh_write_u16(struct ssh_writer *writer, u16 in)
+{
+	put_unaligned_le16(in, writer->ptr);
+	writer->ptr += 2;
+}
+
+inline static void ssh_write_crc(struct ssh_writer *writer, u16 crc)
+{
+	ssh_write_u16(writer, crc);
+}
+
+inline static void ssh_write_syn(struct ssh_writer *writer)
+{
+	u8 *w = writer->ptr;
+
+	*w++ = 0xaa;
+	*w++ = 0x55;
+
+	writer->ptr = w;
+}
+
+inline static void ssh_write_ter(struct ssh_writer *writer)
+{
+	u8 *w = writer->ptr;
+
+	*w++ = 0xff;
+	*w++ = 0xff;
+
+	writer->ptr = w;
+}
+
+inline static void ssh_write_buf(struct ssh_writer *writer,
+				 u8 *in, size_t len)
+{
+	writer->ptr = memcpy(writer->ptr, in, len) + len;
+}
+
+inline static void ssh_write_hdr(struct ssh_writer *writer,
+				 const struct surface_sam_ssh_rqst *rqst,
+				 u8 seq)
+{
+	struct ssh_frame_ctrl *hdr = (struct ssh_frame_ctrl *)writer->ptr;
 	u8 *begin = writer->ptr;
 
 	hdr->type = SSH_FRAME_TYPE_CMD;
 	hdr->len  = SSH_BYTELEN_CMDFRAME + rqst->cdl;	// without CRC
 	hdr->pad  = 0x00;
-	hdr->seq  = ec->counter.seq;
+	hdr->seq  = seq;
 
 	writer->ptr += sizeof(*hdr);
 
-	ssh_write_crc(writer, begin, writer->ptr - begin);
+	ssh_write_crc(writer, ssh_crc(begin, writer->ptr - begin));
 }
 
 inline static void ssh_write_cmd(struct ssh_writer *writer,
 				 const struct surface_sam_ssh_rqst *rqst,
-				 struct sam_ssh_ec *ec)
+				 u16 rqid)
 {
 	struct ssh_frame_cmd *cmd = (struct ssh_frame_cmd *)writer->ptr;
 	u8 *begin = writer->ptr;
+	u16 crc;
 
-	u16 rqid = sam_rqid_to_rqst(ec->counter.rqid);
 	u8 rqid_lo = rqid & 0xFF;
 	u8 rqid_hi = rqid >> 8;
 
@@ -524,455 +1417,2085 @@ inline static void ssh_write_cmd(struct ssh_writer *writer,
 
 	writer->ptr += sizeof(*cmd);
 
-	ssh_write_buf(writer, rqst->pld, rqst->cdl);
-	ssh_write_crc(writer, begin, writer->ptr - begin);
+	// payload is check-summed while being copied
+	crc = ssh_crc(begin, writer->ptr - begin);
+	crc = ssh_crc_copy(crc, writer->ptr, rqst->pld, rqst->cdl);
+	writer->ptr += rqst->cdl;
+
+	ssh_write_crc(writer, crc);
 }
 
-inline static void ssh_write_ack(struct ssh_writer *writer, u8 seq)
+inline static void ssh_write_ctrl(struct ssh_writer *writer, u8 type, u8 seq)
 {
-	struct ssh_frame_ctrl *ack = (struct ssh_frame_ctrl *)writer->ptr;
+	struct ssh_frame_ctrl *ctrl = (struct ssh_frame_ctrl *)writer->ptr;
 	u8 *begin = writer->ptr;
 
-	ack->type = SSH_FRAME_TYPE_ACK;
-	ack->len  = 0x00;
-	ack->pad  = 0x00;
-	ack->seq  = seq;
+	ctrl->type = type;
+	ctrl->len  = 0x00;
+	ctrl->pad  = 0x00;
+	ctrl->seq  = seq;
+
+	writer->ptr += sizeof(*ctrl);
 
-	writer->ptr += sizeof(*ack);
+	ssh_write_crc(writer, ssh_crc(begin, writer->ptr - begin));
+}
 
-	ssh_write_crc(writer, begin, writer->ptr - begin);
+inline static void ssh_writer_reset(struct ssh_writer *writer, u8 *data)
+{
+	writer->data = data;
+	writer->ptr  = data;
 }
 
-inline static void ssh_writer_reset(struct ssh_writer *writer)
+inline static size_t ssh_writer_len(const struct ssh_writer *writer)
 {
-	writer->ptr = writer->data;
+	return writer->ptr - writer->data;
 }
 
-inline static int ssh_writer_flush(struct sam_ssh_ec *ec)
+static int ssh_write_to_device(struct sam_ssh_ec *ec, const u8 *buf, size_t len)
 {
-	struct ssh_writer *writer = &ec->writer;
 	struct serdev_device *serdev = ec->serdev;
 	int status;
 
-	size_t len = writer->ptr - writer->data;
+	dev_dbg(&serdev->dev, "sending message\n");
+	print_hex_dump_debug("send: ", DUMP_PREFIX_OFFSET, 16, 1, buf, len, false);
 
-	dev_dbg(&ec->serdev->dev, "sending message\n");
-	print_hex_dump_debug("send: ", DUMP_PREFIX_OFFSET, 16, 1,
-	                     writer->data, writer->ptr - writer->data, false);
+	mutex_lock(&ec->rtl.tx_lock);
+	status = serdev_device_write(serdev, buf, len, SSH_WRITE_TIMEOUT);
+	mutex_unlock(&ec->rtl.tx_lock);
 
-	status = serdev_device_write(serdev, writer->data, len, SSH_WRITE_TIMEOUT);
 	return status >= 0 ? 0 : status;
 }
 
-inline static void ssh_write_msg_cmd(struct sam_ssh_ec *ec,
-				     const struct surface_sam_ssh_rqst *rqst)
+inline static void ssh_write_msg_cmd(struct ssh_writer *writer,
+				     const struct surface_sam_ssh_rqst *rqst,
+				     u8 seq, u16 rqid)
 {
-	ssh_writer_reset(&ec->writer);
-	ssh_write_syn(&ec->writer);
-	ssh_write_hdr(&ec->writer, rqst, ec);
-	ssh_write_cmd(&ec->writer, rqst, ec);
+	ssh_write_syn(writer);
+	ssh_write_hdr(writer, rqst, seq);
+	ssh_write_cmd(writer, rqst, rqid);
 }
 
-inline static void ssh_write_msg_ack(struct sam_ssh_ec *ec, u8 seq)
+inline static void ssh_write_msg_ctrl(struct ssh_writer *writer, u8 type, u8 seq)
 {
-	ssh_writer_reset(&ec->writer);
-	ssh_write_syn(&ec->writer);
-	ssh_write_ack(&ec->writer, seq);
-	ssh_write_ter(&ec->writer);
+	ssh_write_syn(writer);
+	ssh_write_ctrl(writer, type, seq);
+	ssh_write_ter(writer);
 }
 
-inline static void ssh_receiver_restart(struct sam_ssh_ec *ec,
-					const struct surface_sam_ssh_rqst *rqst)
+/*
+ * Write the ACKs and the RETRY requested by the receiver, up to
+ * SSH_ACK_BATCH_MAX messages. Returns the number of messages written.
+ */
+static unsigned int ssh_write_pending_ctrl(struct sam_ssh_ec *ec, struct ssh_writer *writer)
 {
+	struct ssh_receiver *rcv = &ec->receiver;
+	u8 seq[SSH_ACK_BATCH_MAX];
 	unsigned long flags;
+	unsigned int n, i;
+	bool nak;
 
-	spin_lock_irqsave(&ec->receiver.lock, flags);
-	reinit_completion(&ec->receiver.signal);
-	ec->receiver.state = SSH_RCV_CONTROL;
-	ec->receiver.expect.pld = rqst->snc;
-	ec->receiver.expect.seq = ec->counter.seq;
-	ec->receiver.expect.rqid = sam_rqid_to_rqst(ec->counter.rqid);
-	ec->receiver.eval_buf.len = 0;
-	spin_unlock_irqrestore(&ec->receiver.lock, flags);
+	spin_lock_irqsave(&rcv->lock, flags);
+	n = kfifo_out(&rcv->fifo, seq, SSH_ACK_BATCH_MAX);
+
+	nak = rcv->nak_pending && n < SSH_ACK_BATCH_MAX;
+	if (nak)
+		rcv->nak_pending = false;
+	spin_unlock_irqrestore(&rcv->lock, flags);
+
+	for (i = 0; i < n; i++)
+		ssh_write_msg_ctrl(writer, SSH_FRAME_TYPE_ACK, seq[i]);
+
+	if (nak)
+		ssh_write_msg_ctrl(writer, SSH_FRAME_TYPE_RETRY, 0x00);
+
+	return n + nak;
 }
 
-inline static void ssh_receiver_discard(struct sam_ssh_ec *ec)
-{
-	unsigned long flags;
 
-	spin_lock_irqsave(&ec->receiver.lock, flags);
-	ec->receiver.state = SSH_RCV_DISCARD;
-	ec->receiver.eval_buf.len = 0;
-	kfifo_reset(&ec->receiver.fifo);
-	spin_unlock_irqrestore(&ec->receiver.lock, flags);
+inline static void ssh_request_init(struct ssh_request *rq, struct sam_ssh_ec *ec,
+				    const struct surface_sam_ssh_rqst *rqst,
+				    struct surface_sam_ssh_buf *result,
+				    surface_sam_ssh_rqst_complete_fn complete,
+				    void *complete_data)
+{
+	INIT_LIST_HEAD(&rq->node);
+	rq->ec            = ec;
+	rq->state         = 0;
+	rq->seq           = 0;
+	rq->rqid          = 0;
+	rq->expect_rsp    = rqst->snc && result;
+	rq->status        = 0;
+	rq->try           = 0;
+	rq->timeout       = 0;
+	rq->rqst          = *rqst;
+	rq->rqst.pld      = rq->pld;
+	rq->result        = result;
+	rq->complete      = complete;
+	rq->complete_data = complete_data;
+	rq->msg.len       = 0;
+
+	// copy payload, the caller does not need to keep it around
+	memcpy(rq->pld, rqst->pld, rqst->cdl);
 }
 
-static int surface_sam_ssh_rqst_unlocked(struct sam_ssh_ec *ec,
-					 const struct surface_sam_ssh_rqst *rqst,
-					 struct surface_sam_ssh_buf *result)
+inline static void ssh_request_build(struct ssh_request *rq)
 {
-	struct device *dev = &ec->serdev->dev;
-	struct ssh_fifo_packet packet = {};
-	int status;
-	int try;
-	unsigned int rem;
+	struct ssh_writer writer;
 
-	if (rqst->cdl > SURFACE_SAM_SSH_MAX_RQST_PAYLOAD) {
-		dev_err(dev, SSH_RQST_TAG "request payload too large\n");
-		return -EINVAL;
-	}
+	ssh_writer_reset(&writer, rq->msg.data);
+	ssh_write_msg_cmd(&writer, &rq->rqst, rq->seq, rq->rqid);
+	rq->msg.len = ssh_writer_len(&writer);
+}
+
+/*
+ * Schedule the request work for immediate execution, e.g. after a state
+ * change. Must be called with the rtl lock held and the request pending.
+ */
+inline static void ssh_request_kick(struct ssh_request *rq)
+{
+	mod_delayed_work(rq->ec->rtl.queue, &rq->work, 0);
+}
+
+/*
+ * Select the next request to send. High-priority requests go first, but
+ * after SSH_RQST_HIGH_BURST of them in a row, a waiting normal request gets
+ * its turn, so that normal requests can't be starved. Must be called with the
+ * rtl lock held.
+ */
+static struct ssh_request *ssh_rtl_next(struct ssh_rtl *rtl)
+{
+	struct list_head *high = &rtl->queued[SSH_RQST_CLASS_HIGH];
+	struct list_head *normal = &rtl->queued[SSH_RQST_CLASS_NORMAL];
+
+	if (!list_empty(high) && (list_empty(normal) || rtl->high_burst < SSH_RQST_HIGH_BURST)) {
+		rtl->high_burst = list_empty(normal) ? 0 : rtl->high_burst + 1;
+		return list_first_entry(high, struct ssh_request, node);
+	}
+
+	rtl->high_burst = 0;
+
+	if (!list_empty(normal))
+		return list_first_entry(normal, struct ssh_request, node);
+
+	return NULL;
+}
+
+/*
+ * Move the next queued request to the pending set, if there is a free slot
+ * in the window. This assigns SEQ and RQID, so that these are guaranteed to
+ * be unique among all pending requests.
+ */
+static struct ssh_request *ssh_rtl_promote(struct sam_ssh_ec *ec)
+{
+	struct ssh_rtl *rtl = &ec->rtl;
+	struct ssh_request *rq = NULL;
+	unsigned long flags;
+
+	spin_lock_irqsave(&rtl->lock, flags);
+	if (rtl->num_pending < rtl->window)
+		rq = ssh_rtl_next(rtl);
+
+	if (rq) {
+		rq->seq  = ec->counter.seq++;
+		rq->rqid = sam_rqid_to_rqst(ec->counter.rqid++);
+
+		list_move_tail(&rq->node, &rtl->pending);
+		rtl->num_queued  -= 1;
+		rtl->num_pending += 1;
+	}
+	spin_unlock_irqrestore(&rtl->lock, flags);
+
+	return rq;
+}
+
+static void ssh_request_complete(struct ssh_request *rq, int status)
+{
+	struct sam_ssh_ec *ec = rq->ec;
+	struct ssh_rtl *rtl = &ec->rtl;
+	unsigned long flags;
+
+	spin_lock_irqsave(&rtl->lock, flags);
+	list_del_init(&rq->node);
+	rtl->num_pending -= 1;
+	spin_unlock_irqrestore(&rtl->lock, flags);
+
+	/*
+	 * The request can't be kicked any more after it has been removed from
+	 * the pending set. Cancel any execution that has been scheduled
+	 * before, we're already running.
+	 */
+	cancel_delayed_work(&rq->work);
+
+	// there's a free slot now, try to fill it
+	queue_work(rtl->queue, &rtl->tx_work);
+	wake_up_all(&rtl->waitq);
+
+	if (rq->complete)
+		rq->complete(status, rq->result, rq->complete_data);
+
+	kfree(rq);
+}
+
+static void ssh_rtt_sample(struct ssh_rtt *rtt, s64 sample)
+{
+	s32 r = clamp_t(s64, sample, 0, SSH_RTO_MAX_US);
+	s32 err;
+
+	if (rtt->samples++ == 0) {
+		rtt->srtt   = r;
+		rtt->rttvar = r / 2;
+	} else {
+		err = r - (s32)rtt->srtt;
+		rtt->srtt   = (s32)rtt->srtt + err / 8;
+		rtt->rttvar = (s32)rtt->rttvar + (abs(err) - (s32)rtt->rttvar) / 4;
+	}
+
+	rtt->rto = rtt->srtt + max(jiffies_to_usecs(1), 4 * rtt->rttvar);
+	rtt->rto = clamp_t(u32, rtt->rto, rtt->min, SSH_RTO_MAX_US);
+}
+
+inline static unsigned long ssh_rtt_timeout(const struct ssh_rtt *rtt)
+{
+	return usecs_to_jiffies(READ_ONCE(rtt->rto));
+}
+
+/*
+ * Timeout for the current transmission of the request. The timeout is
+ * doubled on each re-transmission, the last try always uses the maximum
+ * timeout so that we don't give up too early on a slow EC.
+ */
+inline static unsigned long ssh_request_ack_timeout(struct ssh_request *rq)
+{
+	unsigned long timeout = ssh_rtt_timeout(&rq->ec->rtl.rtt_ack);
+
+	if (rq->try >= SSH_NUM_RETRY)
+		return SSH_READ_TIMEOUT;
+
+	return min(timeout << (rq->try - 1), SSH_READ_TIMEOUT);
+}
+
+/*
+ * Prepare the request for (re-)transmission. The timeout is armed before
+ * sending, so that we don't override the work scheduled by a fast ACK.
+ */
+inline static void ssh_request_arm(struct ssh_request *rq)
+{
+	unsigned long timeout;
+
+	rq->try += 1;
+	rq->tx_time = ktime_get();
+	clear_bit(SSH_RQST_SF_NAKED_BIT, &rq->state);
+
+	timeout = ssh_request_ack_timeout(rq);
+	rq->timeout = jiffies + timeout;
+
+	mod_delayed_work(rq->ec->rtl.queue, &rq->work, timeout);
+}
+
+static void ssh_request_transmit(struct ssh_request *rq)
+{
+	int status;
+
+	ssh_request_arm(rq);
+
+	status = ssh_write_to_device(rq->ec, rq->msg.data, rq->msg.len);
+	if (status) {
+		ssh_request_complete(rq, status);
+	}
+}
+
+inline static unsigned long ssh_breaker_interval(void)
+{
+	return msecs_to_jiffies(max_t(unsigned int, READ_ONCE(rqst_breaker_interval),
+				      SSH_BREAKER_INTERVAL_MIN));
+}
+
+/*
+ * Record the outcome of a request: Either the EC answered it (ACK or
+ * response) or it timed out. Called from the request work.
+ */
+static void ssh_breaker_update(struct sam_ssh_ec *ec, bool answered)
+{
+	unsigned int threshold = READ_ONCE(rqst_breaker_threshold);
+	struct ssh_breaker *b = &ec->rtl.breaker;
+	enum ssh_breaker_state old, new;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ec->rtl.lock, flags);
+	old = b->state;
+
+	if (answered) {
+		b->num_failed = 0;
+		b->state = SSH_BREAKER_CLOSED;
+	} else {
+		b->num_failed += 1;
+
+		if (old == SSH_BREAKER_CLOSED && threshold && b->num_failed >= threshold) {
+			b->state = SSH_BREAKER_OPEN;
+			b->num_trip += 1;
+
+			if (b->active)
+				queue_delayed_work(ec->rtl.queue, &b->probe, ssh_breaker_interval());
+		}
+	}
+
+	new = b->state;
+	spin_unlock_irqrestore(&ec->rtl.lock, flags);
+
+	if (old == SSH_BREAKER_CLOSED && new != SSH_BREAKER_CLOSED)
+		dev_warn(&ec->serdev->dev, SSH_RQST_TAG "EC not responding, failing requests fast\n");
+	else if (old != SSH_BREAKER_CLOSED && new == SSH_BREAKER_CLOSED)
+		dev_info(&ec->serdev->dev, SSH_RQST_TAG "EC responding again\n");
+}
+
+static void ssh_request_work_fn(struct work_struct *work)
+{
+	struct ssh_request *rq = container_of(to_delayed_work(work), struct ssh_request, work);
+	struct device *dev = &rq->ec->serdev->dev;
+
+	// the response implies an ACK, thus check for it first
+	if (test_bit(SSH_RQST_SF_RSPRCVD_BIT, &rq->state)) {
+		ssh_breaker_update(rq->ec, true);
+		ssh_request_complete(rq, rq->status);
+		return;
+	}
+
+	if (test_bit(SSH_RQST_SF_ACKED_BIT, &rq->state)) {
+		if (!rq->expect_rsp) {
+			ssh_breaker_update(rq->ec, true);
+			ssh_request_complete(rq, 0);
+			return;
+		}
+
+		/*
+		 * ACK received, now wait for the response. This is not a
+		 * re-transmission timer: a late response can't be matched
+		 * any more, thus always allow the EC the full read timeout.
+		 */
+		if (!test_and_set_bit(SSH_RQST_SF_AWAITRSP_BIT, &rq->state)) {
+			rq->timeout = jiffies + SSH_READ_TIMEOUT;
+		}
+
+		if (time_before(jiffies, rq->timeout)) {
+			mod_delayed_work(rq->ec->rtl.queue, &rq->work, rq->timeout - jiffies);
+			return;
+		}
+
+		dev_err(dev, SSH_RQST_TAG "communication timed out\n");
+		atomic_inc(&rq->ec->rtl.num_timeout);
+		ssh_breaker_update(rq->ec, false);
+		ssh_request_complete(rq, -EIO);
+		return;
+	}
+
+	// neither ACKed nor NAKed and not timed out: spurious wakeup
+	if (!test_bit(SSH_RQST_SF_NAKED_BIT, &rq->state)
+	    && time_before(jiffies, rq->timeout)) {
+		mod_delayed_work(rq->ec->rtl.queue, &rq->work, rq->timeout - jiffies);
+		return;
+	}
+
+	// check if we ran out of tries?
+	if (rq->try >= SSH_NUM_RETRY) {
+		dev_err(dev, SSH_RQST_TAG "communication failed %d times, giving up\n", rq->try);
+		atomic_inc(&rq->ec->rtl.num_timeout);
+		ssh_breaker_update(rq->ec, false);
+		ssh_request_complete(rq, -EIO);
+		return;
+	}
+
+	atomic_inc(&rq->ec->rtl.num_retransmit);
+	ssh_request_transmit(rq);
+}
+
+/*
+ * Transmit all requests that fit into the window. The frames of all
+ * promoted requests are collected in the transmit buffer and sent with a
+ * single write, preceded by any ACKs pending at that time. Re-transmissions
+ * are sent individually by the request work.
+ */
+static void ssh_rtl_tx_work_fn(struct work_struct *work)
+{
+	struct sam_ssh_ec *ec = container_of(work, struct sam_ssh_ec, rtl.tx_work);
+	struct ssh_request *batch[SSH_RQST_WINDOW_MAX];
+	struct ssh_writer writer;
+	struct ssh_request *rq;
+	unsigned int n = 0, i;
+	int status;
+
+	ssh_writer_reset(&writer, ec->rtl.tx_buf);
+	ssh_write_pending_ctrl(ec, &writer);
+
+	while (n < ARRAY_SIZE(batch) && (rq = ssh_rtl_promote(ec))) {
+		// write command in buffer, we may need it multiple times
+		ssh_request_build(rq);
+		ssh_request_arm(rq);
+
+		ssh_write_buf(&writer, rq->msg.data, rq->msg.len);
+		batch[n++] = rq;
+	}
+
+	if (!ssh_writer_len(&writer)) {
+		return;
+	}
+
+	status = ssh_write_to_device(ec, writer.data, ssh_writer_len(&writer));
+	if (status) {
+		for (i = 0; i < n; i++) {
+			ssh_request_complete(batch[i], status);
+		}
+	}
+}
+
+static struct ssh_request *ssh_request_alloc(struct sam_ssh_ec *ec,
+					     const struct surface_sam_ssh_rqst *rqst,
+					     struct surface_sam_ssh_buf *result,
+					     surface_sam_ssh_rqst_complete_fn complete,
+					     void *complete_data)
+{
+	struct ssh_request *rq;
+
+	if (rqst->cdl > SURFACE_SAM_SSH_MAX_RQST_PAYLOAD) {
+		dev_err(&ec->serdev->dev, SSH_RQST_TAG "request payload too large\n");
+		return ERR_PTR(-EINVAL);
+	}
+
+	rq = kzalloc(sizeof(*rq), GFP_KERNEL);
+	if (!rq) {
+		return ERR_PTR(-ENOMEM);
+	}
+
+	ssh_request_init(rq, ec, rqst, result, complete, complete_data);
+	INIT_DELAYED_WORK(&rq->work, ssh_request_work_fn);
+
+	return rq;
+}
+
+/*
+ * Queue all requests on the given list for transmission, in order and with
+ * a single lock acquisition. To keep them in order, the requests are only
+ * queued as high-priority if all of them are.
+ */
+static void ssh_rtl_submit_list(struct sam_ssh_ec *ec, struct list_head *list,
+				unsigned int count)
+{
+	enum ssh_rqst_class class = SSH_RQST_CLASS_HIGH;
+	struct ssh_rtl *rtl = &ec->rtl;
+	struct ssh_request *rq;
+	unsigned long flags;
+
+	list_for_each_entry(rq, list, node) {
+		if (rq->rqst.pri != SURFACE_SAM_PRIORITY_HIGH)
+			class = SSH_RQST_CLASS_NORMAL;
+	}
+
+	spin_lock_irqsave(&rtl->lock, flags);
+	list_splice_tail_init(list, &rtl->queued[class]);
+	rtl->num_queued += count;
+	spin_unlock_irqrestore(&rtl->lock, flags);
+
+	queue_work(rtl->queue, &rtl->tx_work);
+}
+
+static int ssh_rtl_submit(struct sam_ssh_ec *ec,
+			  const struct surface_sam_ssh_rqst *rqst,
+			  struct surface_sam_ssh_buf *result,
+			  surface_sam_ssh_rqst_complete_fn complete,
+			  void *complete_data)
+{
+	struct ssh_request *rq;
+	LIST_HEAD(list);
+
+	rq = ssh_request_alloc(ec, rqst, result, complete, complete_data);
+	if (IS_ERR(rq)) {
+		return PTR_ERR(rq);
+	}
+
+	list_add_tail(&rq->node, &list);
+	ssh_rtl_submit_list(ec, &list, 1);
+
+	return 0;
+}
+
+inline static bool ssh_rtl_is_idle(struct ssh_rtl *rtl)
+{
+	unsigned long flags;
+	bool idle;
+
+	spin_lock_irqsave(&rtl->lock, flags);
+	idle = rtl->num_queued == 0 && rtl->num_pending == 0;
+	spin_unlock_irqrestore(&rtl->lock, flags);
+
+	return idle;
+}
+
+static void ssh_breaker_probe_complete(int status, struct surface_sam_ssh_buf *result, void *data)
+{
+	struct sam_ssh_ec *ec = data;
+	struct ssh_breaker *b = &ec->rtl.breaker;
+	unsigned long flags;
+
+	// on success, the breaker has already been closed by the request work
+	spin_lock_irqsave(&ec->rtl.lock, flags);
+	if (b->state == SSH_BREAKER_PROBING) {
+		b->state = SSH_BREAKER_OPEN;
+
+		if (b->active)
+			queue_delayed_work(ec->rtl.queue, &b->probe, ssh_breaker_interval());
+	}
+	spin_unlock_irqrestore(&ec->rtl.lock, flags);
+}
+
+/*
+ * Probe an unresponsive EC with a cheap request (get firmware version). The
+ * probe bypasses the breaker, its outcome is recorded like that of any other
+ * request.
+ */
+static void ssh_breaker_probe_fn(struct work_struct *work)
+{
+	struct sam_ssh_ec *ec = container_of(to_delayed_work(work), struct sam_ssh_ec, rtl.breaker.probe);
+	struct ssh_breaker *b = &ec->rtl.breaker;
+	unsigned long flags;
+	bool send;
+	int status;
+
+	struct surface_sam_ssh_rqst rqst = {
+		.tc  = 0x01,
+		.cid = 0x13,
+		.iid = 0x00,
+		.pri = SURFACE_SAM_PRIORITY_NORMAL,
+		.snc = 0x01,
+		.cdl = 0x00,
+		.pld = NULL,
+	};
+
+	spin_lock_irqsave(&ec->rtl.lock, flags);
+	send = b->active && b->state == SSH_BREAKER_OPEN;
+	if (send)
+		b->state = SSH_BREAKER_PROBING;
+	spin_unlock_irqrestore(&ec->rtl.lock, flags);
+
+	if (!send)
+		return;
+
+	b->probe_result.cap  = ARRAY_SIZE(b->probe_buf);
+	b->probe_result.len  = 0;
+	b->probe_result.data = b->probe_buf;
+
+	status = ssh_rtl_submit(ec, &rqst, &b->probe_result, ssh_breaker_probe_complete, ec);
+	if (status)
+		ssh_breaker_probe_complete(status, NULL, ec);
+}
+
+/*
+ * Check whether a new request may be submitted. Rejects the request while
+ * the breaker is open or probing.
+ */
+static int ssh_breaker_admit(struct sam_ssh_ec *ec)
+{
+	struct ssh_breaker *b = &ec->rtl.breaker;
+	unsigned long flags;
+	int status = 0;
+
+	spin_lock_irqsave(&ec->rtl.lock, flags);
+	if (b->state != SSH_BREAKER_CLOSED && READ_ONCE(rqst_breaker_threshold)) {
+		b->num_rejected += 1;
+		status = -ETIMEDOUT;
+	}
+	spin_unlock_irqrestore(&ec->rtl.lock, flags);
+
+	return status;
+}
+
+/*
+ * Allow probes to be sent. If the breaker has been tripped while inactive,
+ * probe right away.
+ */
+static void ssh_breaker_start(struct sam_ssh_ec *ec)
+{
+	struct ssh_breaker *b = &ec->rtl.breaker;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ec->rtl.lock, flags);
+	b->active = true;
+	if (b->state == SSH_BREAKER_OPEN)
+		mod_delayed_work(ec->rtl.queue, &b->probe, 0);
+	spin_unlock_irqrestore(&ec->rtl.lock, flags);
+}
+
+/*
+ * Stop sending probes. A probe already in flight is not re-scheduled, the
+ * caller can wait for it via ssh_rtl_flush.
+ */
+static void ssh_breaker_stop(struct sam_ssh_ec *ec)
+{
+	struct ssh_breaker *b = &ec->rtl.breaker;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ec->rtl.lock, flags);
+	b->active = false;
+	spin_unlock_irqrestore(&ec->rtl.lock, flags);
+
+	cancel_delayed_work_sync(&b->probe);
+}
+
+/*
+ * Wait until all submitted requests have been completed. The caller has to
+ * ensure that no new requests are submitted in the meantime.
+ */
+static void ssh_rtl_flush(struct sam_ssh_ec *ec)
+{
+	wait_event(ec->rtl.waitq, ssh_rtl_is_idle(&ec->rtl));
+}
+
+/*
+ * Match an incoming ACK or RETRY control message to the pending requests.
+ * ACKs are matched via SEQ, a RETRY (which does not carry a valid SEQ)
+ * applies to all requests not acknowledged yet. Called from the dispatcher.
+ */
+static bool ssh_rtl_handle_ctrl(struct sam_ssh_ec *ec,
+				const struct ssh_frame_ctrl *ctrl)
+{
+	struct ssh_rtl *rtl = &ec->rtl;
+	struct ssh_request *rq;
+	unsigned long flags;
+	bool matched = false;
+
+	spin_lock_irqsave(&rtl->lock, flags);
+	list_for_each_entry(rq, &rtl->pending, node) {
+		if (test_bit(SSH_RQST_SF_ACKED_BIT, &rq->state))
+			continue;
+
+		if (ctrl->type == SSH_FRAME_TYPE_RETRY) {
+			set_bit(SSH_RQST_SF_NAKED_BIT, &rq->state);
+			ssh_request_kick(rq);
+			matched = true;
+
+		} else if (rq->seq == ctrl->seq) {
+			rq->ack_time = ktime_get();
+
+			// only sample unambiguous round-trips (Karn's algorithm)
+			if (rq->try == 1)
+				ssh_rtt_sample(&rtl->rtt_ack, ktime_us_delta(rq->ack_time, rq->tx_time));
+
+			set_bit(SSH_RQST_SF_ACKED_BIT, &rq->state);
+			ssh_request_kick(rq);
+			matched = true;
+			break;
+		}
+	}
+	spin_unlock_irqrestore(&rtl->lock, flags);
+
+	return matched;
+}
+
+static struct ssh_request *ssh_rtl_find_rqid(struct ssh_rtl *rtl, u16 rqid)
+{
+	struct ssh_request *rq;
+
+	list_for_each_entry(rq, &rtl->pending, node) {
+		if (rq->rqid == rqid && rq->expect_rsp
+		    && !test_bit(SSH_RQST_SF_RSPRCVD_BIT, &rq->state))
+			return rq;
+	}
+
+	return NULL;
+}
+
+/*
+ * Hand the payload of an incoming response over to the owning request. The
+ * payload is copied directly into the result buffer of the request. Called
+ * from the dispatcher.
+ */
+static bool ssh_rtl_handle_response(struct sam_ssh_ec *ec, u16 rqid,
+				    const u8 *pld, size_t len)
+{
+	struct ssh_rtl *rtl = &ec->rtl;
+	struct ssh_request *rq;
+	unsigned long flags;
+	ktime_t start;
+
+	spin_lock_irqsave(&rtl->lock, flags);
+	rq = ssh_rtl_find_rqid(rtl, rqid);
+
+	if (rq && rq->result->cap >= len) {
+		memcpy(rq->result->data, pld, len);
+		rq->result->len = len;
+		rq->status = 0;
+	} else if (rq) {
+		rq->status = -EINVAL;
+	}
+
+	if (rq && rq->try == 1) {
+		start = test_bit(SSH_RQST_SF_ACKED_BIT, &rq->state) ? rq->ack_time : rq->tx_time;
+		ssh_rtt_sample(&rtl->rtt_rsp, ktime_us_delta(ktime_get(), start));
+	}
+
+	if (rq) {
+		set_bit(SSH_RQST_SF_ACKED_BIT, &rq->state);
+		set_bit(SSH_RQST_SF_RSPRCVD_BIT, &rq->state);
+		ssh_request_kick(rq);
+	}
+	spin_unlock_irqrestore(&rtl->lock, flags);
+
+	return rq != NULL;
+}
+
+/*
+ * Send the ACKs and the RETRY requested by the receiver, unless they have
+ * already been sent along with request frames.
+ */
+static void ssh_rtl_ack_work_fn(struct work_struct *work)
+{
+	struct sam_ssh_ec *ec = container_of(work, struct sam_ssh_ec, rtl.ack_work);
+	u8 buf[SSH_ACK_BATCH_MAX * SSH_MSG_LEN_CTRL];
+	struct ssh_writer writer;
+	int status;
+
+	// make sure we load a fresh ec state
+	smp_mb();
+
+	if (ec->state == SSH_EC_UNINITIALIZED)
+		return;
+
+	while (true) {
+		ssh_writer_reset(&writer, buf);
+		if (!ssh_write_pending_ctrl(ec, &writer))
+			break;
+
+		status = ssh_write_to_device(ec, buf, ssh_writer_len(&writer));
+		if (status) {
+			dev_err(&ec->serdev->dev, SSH_RQST_TAG
+				"failed to send ACK: %d\n", status);
+		}
+	}
+}
+
+struct ssh_rqst_sync {
+	struct completion signal;
+	int status;
+};
+
+static void ssh_rqst_sync_complete(int status, struct surface_sam_ssh_buf *result, void *data)
+{
+	struct ssh_rqst_sync *sync = data;
+
+	sync->status = status;
+	complete(&sync->signal);
+}
+
+static int surface_sam_ssh_rqst_unlocked(struct sam_ssh_ec *ec,
+					 const struct surface_sam_ssh_rqst *rqst,
+					 struct surface_sam_ssh_buf *result)
+{
+	struct ssh_rqst_sync sync;
+	int status;
+
+	init_completion(&sync.signal);
+	sync.status = 0;
+
+	status = ssh_rtl_submit(ec, rqst, result, ssh_rqst_sync_complete, &sync);
+	if (status) {
+		return status;
+	}
+
+	wait_for_completion(&sync.signal);
+	return sync.status;
+}
+
+int surface_sam_ssh_rqst_async(const struct surface_sam_ssh_rqst *rqst,
+			       struct surface_sam_ssh_buf *result,
+			       surface_sam_ssh_rqst_complete_fn complete,
+			       void *complete_data)
+{
+	struct sam_ssh_ec *ec;
+	int status;
+
+	ec = surface_sam_ssh_acquire_shared_init();
+	if (!ec) {
+		printk(KERN_WARNING SSH_RQST_TAG_FULL "embedded controller is uninitialized\n");
+		return -ENXIO;
+	}
+
+	if (ec->state == SSH_EC_SUSPENDED) {
+		dev_warn(&ec->serdev->dev, SSH_RQST_TAG "embedded controller is suspended\n");
+
+		surface_sam_ssh_release_shared(ec);
+		return -EPERM;
+	}
+
+	status = ssh_breaker_admit(ec);
+	if (status) {
+		surface_sam_ssh_release_shared(ec);
+		return status;
+	}
+
+	status = ssh_rtl_submit(ec, rqst, result, complete, complete_data);
+
+	surface_sam_ssh_release_shared(ec);
+	return status;
+}
+EXPORT_SYMBOL_GPL(surface_sam_ssh_rqst_async);
+
+struct ssh_cache_table {
+	struct list_head node;
+	const struct surface_sam_ssh_cache_rule *rules;
+	unsigned int count;
+};
+
+struct ssh_cache_entry {
+	struct list_head node;
+	u32 hash;
+	unsigned long expires;
+	u8 tc;
+	u8 cid;
+	u8 iid;
+	u8 cdl;
+	u8 pld[SURFACE_SAM_SSH_MAX_RQST_PAYLOAD];
+	u8 len;
+	u8 data[SURFACE_SAM_SSH_MAX_RQST_RESPONSE];
+};
+
+inline static u32 ssh_cache_hash(const struct surface_sam_ssh_rqst *rqst)
+{
+	return jhash(rqst->pld, rqst->cdl, (rqst->tc << 16) | (rqst->cid << 8) | rqst->iid);
+}
+
+/*
+ * Get the TTL (in jiffies) of the command of the request, zero if it can't
+ * be cached. Must be called with the cache lock held.
+ */
+static unsigned long ssh_cache_ttl(struct ssh_cache *cache, const struct surface_sam_ssh_rqst *rqst)
+{
+	struct ssh_cache_table *t;
+	unsigned int i;
+
+	if (!rqst->snc || rqst->cdl > SURFACE_SAM_SSH_MAX_RQST_PAYLOAD)
+		return 0;
+
+	list_for_each_entry(t, &cache->tables, node) {
+		for (i = 0; i < t->count; i++) {
+			if (t->rules[i].tc == rqst->tc && t->rules[i].cid == rqst->cid)
+				return msecs_to_jiffies(t->rules[i].ttl);
+		}
+	}
+
+	return 0;
+}
+
+static struct ssh_cache_entry *ssh_cache_find(struct ssh_cache *cache,
+					      const struct surface_sam_ssh_rqst *rqst,
+					      u32 hash)
+{
+	struct ssh_cache_entry *e;
+
+	list_for_each_entry(e, &cache->entries, node) {
+		if (e->hash != hash || e->tc != rqst->tc || e->cid != rqst->cid
+		    || e->iid != rqst->iid || e->cdl != rqst->cdl)
+			continue;
+
+		if (memcmp(e->pld, rqst->pld, rqst->cdl) == 0)
+			return e;
+	}
+
+	return NULL;
+}
+
+inline static void ssh_cache_drop(struct ssh_cache *cache, struct ssh_cache_entry *e)
+{
+	list_del(&e->node);
+	cache->num_entries -= 1;
+	kfree(e);
+}
+
+/*
+ * Look up the response to the request. Returns true on a hit, in which case
+ * the result has been filled in. Otherwise, ttl is set to the TTL of the
+ * command (zero if it can't be cached) and gen to the current generation,
+ * both to be passed to ssh_cache_store().
+ */
+static bool ssh_cache_lookup(struct ssh_cache *cache, const struct surface_sam_ssh_rqst *rqst,
+			     struct surface_sam_ssh_buf *result, unsigned long *ttl,
+			     unsigned int *gen)
+{
+	struct ssh_cache_entry *e;
+	bool hit = false;
+
+	*ttl = 0;
+	*gen = 0;
+
+	if (!result || !test_bit(SSH_CACHE_KEY(rqst->tc, rqst->cid), cache->cached))
+		return false;
+
+	mutex_lock(&cache->lock);
+
+	*ttl = ssh_cache_ttl(cache, rqst);
+	*gen = cache->generation;
+
+	if (*ttl) {
+		e = ssh_cache_find(cache, rqst, ssh_cache_hash(rqst));
+
+		if (e && time_is_before_eq_jiffies(e->expires)) {
+			ssh_cache_drop(cache, e);
+			e = NULL;
+		}
+
+		if (e && e->len <= result->cap) {
+			memcpy(result->data, e->data, e->len);
+			result->len = e->len;
+			hit = true;
+		}
+
+		if (hit)
+			cache->num_hit += 1;
+		else
+			cache->num_miss += 1;
+	}
+
+	mutex_unlock(&cache->lock);
+	return hit;
+}
+
+static void ssh_cache_store(struct ssh_cache *cache, const struct surface_sam_ssh_rqst *rqst,
+			    const struct surface_sam_ssh_buf *result, unsigned long ttl,
+			    unsigned int gen)
+{
+	struct ssh_cache_entry *e, *n;
+	u32 hash = ssh_cache_hash(rqst);
+
+	mutex_lock(&cache->lock);
+
+	// invalidated while the request was in flight, the response may be stale
+	if (cache->generation != gen)
+		goto out;
+
+	e = ssh_cache_find(cache, rqst, hash);
+	if (e) {
+		list_move_tail(&e->node, &cache->entries);
+	} else {
+		// make room: drop expired entries, or the oldest one if none
+		if (cache->num_entries >= SSH_CACHE_MAX_ENTRIES) {
+			list_for_each_entry_safe(e, n, &cache->entries, node) {
+				if (time_is_before_eq_jiffies(e->expires))
+					ssh_cache_drop(cache, e);
+			}
+		}
+
+		if (cache->num_entries >= SSH_CACHE_MAX_ENTRIES) {
+			e = list_first_entry(&cache->entries, struct ssh_cache_entry, node);
+			ssh_cache_drop(cache, e);
+		}
+
+		e = kzalloc(sizeof(*e), GFP_KERNEL);
+		if (!e)
+			goto out;
+
+		e->hash = hash;
+		e->tc   = rqst->tc;
+		e->cid  = rqst->cid;
+		e->iid  = rqst->iid;
+		e->cdl  = rqst->cdl;
+		memcpy(e->pld, rqst->pld, rqst->cdl);
+
+		list_add_tail(&e->node, &cache->entries);
+		cache->num_entries += 1;
+	}
+
+	e->expires = jiffies + ttl;
+	e->len = result->len;
+	memcpy(e->data, result->data, result->len);
+
+out:
+	mutex_unlock(&cache->lock);
+}
+
+/*
+ * Drop all cached responses of the given command, or all responses if all is
+ * true. Must be called with the cache lock held.
+ */
+static void ssh_cache_invalidate_unlocked(struct ssh_cache *cache, u8 tc, u8 cid, bool all)
+{
+	struct ssh_cache_entry *e, *n;
+
+	list_for_each_entry_safe(e, n, &cache->entries, node) {
+		if (all || (e->tc == tc && e->cid == cid)) {
+			ssh_cache_drop(cache, e);
+			cache->num_invalidated += 1;
+		}
+	}
+
+	cache->generation += 1;
+}
+
+static void ssh_cache_clear(struct ssh_cache *cache)
+{
+	mutex_lock(&cache->lock);
+	ssh_cache_invalidate_unlocked(cache, 0, 0, true);
+	mutex_unlock(&cache->lock);
+}
+
+void surface_sam_ssh_cache_invalidate(u8 tc, u8 cid)
+{
+	struct ssh_cache *cache = &ssh_ec.cache;
+
+	mutex_lock(&cache->lock);
+	ssh_cache_invalidate_unlocked(cache, tc, cid, false);
+	mutex_unlock(&cache->lock);
+}
+EXPORT_SYMBOL_GPL(surface_sam_ssh_cache_invalidate);
+
+int surface_sam_ssh_cache_register(const struct surface_sam_ssh_cache_rule *rules, unsigned int count)
+{
+	struct ssh_cache *cache = &ssh_ec.cache;
+	struct ssh_cache_table *t;
+	unsigned int i;
+
+	t = kzalloc(sizeof(*t), GFP_KERNEL);
+	if (!t) {
+		return -ENOMEM;
+	}
+
+	t->rules = rules;
+	t->count = count;
+
+	mutex_lock(&cache->lock);
+	list_add_tail(&t->node, &cache->tables);
+
+	for (i = 0; i < count; i++)
+		set_bit(SSH_CACHE_KEY(rules[i].tc, rules[i].cid), cache->cached);
+	mutex_unlock(&cache->lock);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(surface_sam_ssh_cache_register);
+
+void surface_sam_ssh_cache_unregister(const struct surface_sam_ssh_cache_rule *rules)
+{
+	struct ssh_cache *cache = &ssh_ec.cache;
+	struct ssh_cache_table *t, *n;
+	unsigned int i;
+
+	mutex_lock(&cache->lock);
+	list_for_each_entry_safe(t, n, &cache->tables, node) {
+		if (t->rules != rules)
+			continue;
+
+		for (i = 0; i < t->count; i++) {
+			clear_bit(SSH_CACHE_KEY(rules[i].tc, rules[i].cid), cache->cached);
+			ssh_cache_invalidate_unlocked(cache, rules[i].tc, rules[i].cid, false);
+		}
+
+		list_del(&t->node);
+		kfree(t);
+	}
+
+	// other tables may cover the same commands
+	list_for_each_entry(t, &cache->tables, node) {
+		for (i = 0; i < t->count; i++)
+			set_bit(SSH_CACHE_KEY(t->rules[i].tc, t->rules[i].cid), cache->cached);
+	}
+	mutex_unlock(&cache->lock);
+}
+EXPORT_SYMBOL_GPL(surface_sam_ssh_cache_unregister);
+
+int surface_sam_ssh_rqst(const struct surface_sam_ssh_rqst *rqst, struct surface_sam_ssh_buf *result)
+{
+	struct ssh_rqst_sync sync;
+	unsigned long ttl;
+	unsigned int gen;
+	int status;
+
+	if (ssh_cache_lookup(&ssh_ec.cache, rqst, result, &ttl, &gen)) {
+		return 0;
+	}
+
+	init_completion(&sync.signal);
+	sync.status = 0;
+
+	status = surface_sam_ssh_rqst_async(rqst, result, ssh_rqst_sync_complete, &sync);
+	if (status) {
+		return status;
+	}
+
+	wait_for_completion(&sync.signal);
+
+	if (!sync.status && ttl) {
+		ssh_cache_store(&ssh_ec.cache, rqst, result, ttl, gen);
+	}
+
+	return sync.status;
+}
+EXPORT_SYMBOL_GPL(surface_sam_ssh_rqst);
+
+
+struct ssh_rqst_batch {
+	struct completion signal;
+	atomic_t remaining;
+};
+
+struct ssh_rqst_batch_entry {
+	struct ssh_rqst_batch *batch;
+	int status;
+};
+
+static void ssh_rqst_batch_complete(int status, struct surface_sam_ssh_buf *result, void *data)
+{
+	struct ssh_rqst_batch_entry *entry = data;
+	struct ssh_rqst_batch *batch = entry->batch;
+
+	entry->status = status;
+
+	if (atomic_dec_and_test(&batch->remaining))
+		complete(&batch->signal);
+}
+
+int surface_sam_ssh_rqst_batch(const struct surface_sam_ssh_rqst *rqst,
+			       struct surface_sam_ssh_buf **result,
+			       int *status, unsigned int count)
+{
+	struct ssh_rqst_batch_entry *entries;
+	struct ssh_rqst_batch batch;
+	struct ssh_request *rq, *n;
+	struct sam_ssh_ec *ec;
+	unsigned int i;
+	LIST_HEAD(list);
+	int err = 0;
+
+	if (!count) {
+		return 0;
+	}
+
+	entries = kcalloc(count, sizeof(*entries), GFP_KERNEL);
+	if (!entries) {
+		err = -ENOMEM;
+		goto err_alloc;
+	}
+
+	init_completion(&batch.signal);
+	atomic_set(&batch.remaining, count);
+
+	ec = surface_sam_ssh_acquire_shared_init();
+	if (!ec) {
+		printk(KERN_WARNING SSH_RQST_TAG_FULL "embedded controller is uninitialized\n");
+		err = -ENXIO;
+		goto err_init;
+	}
+
+	if (ec->state == SSH_EC_SUSPENDED) {
+		dev_warn(&ec->serdev->dev, SSH_RQST_TAG "embedded controller is suspended\n");
+		err = -EPERM;
+		goto err_submit;
+	}
+
+	err = ssh_breaker_admit(ec);
+	if (err) {
+		goto err_submit;
+	}
+
+	// allocate everything first, we want to submit all or nothing
+	for (i = 0; i < count; i++) {
+		entries[i].batch = &batch;
+
+		rq = ssh_request_alloc(ec, &rqst[i], result ? result[i] : NULL,
+				       ssh_rqst_batch_complete, &entries[i]);
+		if (IS_ERR(rq)) {
+			err = PTR_ERR(rq);
+			goto err_submit;
+		}
+
+		list_add_tail(&rq->node, &list);
+	}
+
+	ssh_rtl_submit_list(ec, &list, count);
+	surface_sam_ssh_release_shared(ec);
+
+	wait_for_completion(&batch.signal);
+
+	for (i = 0; i < count; i++) {
+		if (status)
+			status[i] = entries[i].status;
+
+		if (!err)
+			err = entries[i].status;
+	}
+
+	kfree(entries);
+	return err;
+
+err_submit:
+	list_for_each_entry_safe(rq, n, &list, node) {
+		list_del(&rq->node);
+		kfree(rq);
+	}
+	surface_sam_ssh_release_shared(ec);
+err_init:
+	kfree(entries);
+err_alloc:
+	for (i = 0; status && i < count; i++)
+		status[i] = err;
+
+	return err;
+}
+EXPORT_SYMBOL_GPL(surface_sam_ssh_rqst_batch);
+
+
+struct ssh_flight {
+	struct list_head node;
+	unsigned int refcount;		// protected by flights lock
+	struct completion done;
+	int status;
+	struct surface_sam_ssh_rqst rqst;
+	u8 pld[SURFACE_SAM_SSH_MAX_RQST_PAYLOAD];
+	struct surface_sam_ssh_buf result;
+	u8 data[SURFACE_SAM_SSH_MAX_RQST_RESPONSE];
+};
+
+static struct ssh_flight *ssh_flight_find(struct ssh_flights *flights,
+					  const struct surface_sam_ssh_rqst *rqst)
+{
+	struct ssh_flight *f;
+
+	list_for_each_entry(f, &flights->list, node) {
+		if (f->rqst.tc != rqst->tc || f->rqst.cid != rqst->cid
+		    || f->rqst.iid != rqst->iid || f->rqst.pri != rqst->pri
+		    || f->rqst.cdl != rqst->cdl)
+			continue;
+
+		if (memcmp(f->pld, rqst->pld, rqst->cdl) == 0)
+			return f;
+	}
+
+	return NULL;
+}
+
+static void ssh_flight_put(struct ssh_flights *flights, struct ssh_flight *f)
+{
+	bool last;
+
+	mutex_lock(&flights->lock);
+	last = --f->refcount == 0;
+	mutex_unlock(&flights->lock);
+
+	if (last)
+		kfree(f);
+}
+
+int surface_sam_ssh_rqst_shared(const struct surface_sam_ssh_rqst *rqst, struct surface_sam_ssh_buf *result)
+{
+	struct ssh_flights *flights = &ssh_ec.flights;
+	struct ssh_flight *f;
+	int status;
+
+	// only requests with response can be shared
+	if (!rqst->snc || rqst->cdl > SURFACE_SAM_SSH_MAX_RQST_PAYLOAD) {
+		return surface_sam_ssh_rqst(rqst, result);
+	}
+
+	mutex_lock(&flights->lock);
+	f = ssh_flight_find(flights, rqst);
+	if (f) {
+		f->refcount += 1;
+		mutex_unlock(&flights->lock);
+
+		atomic_inc(&flights->num_shared);
+		wait_for_completion(&f->done);
+	} else {
+		f = kzalloc(sizeof(*f), GFP_KERNEL);
+		if (!f) {
+			mutex_unlock(&flights->lock);
+			return -ENOMEM;
+		}
+
+		f->refcount = 1;
+		init_completion(&f->done);
+		f->rqst = *rqst;
+		f->rqst.pld = f->pld;
+		memcpy(f->pld, rqst->pld, rqst->cdl);
+		f->result.cap = SURFACE_SAM_SSH_MAX_RQST_RESPONSE;
+		f->result.data = f->data;
+
+		list_add_tail(&f->node, &flights->list);
+		mutex_unlock(&flights->lock);
+
+		f->status = surface_sam_ssh_rqst(&f->rqst, &f->result);
+
+		// requests submitted from now on need their own round-trip
+		mutex_lock(&flights->lock);
+		list_del(&f->node);
+		mutex_unlock(&flights->lock);
+
+		complete_all(&f->done);
+	}
+
+	status = f->status;
+	if (!status && f->result.len > result->cap) {
+		status = -EINVAL;
+	} else if (!status) {
+		memcpy(result->data, f->data, f->result.len);
+		result->len = f->result.len;
+	}
+
+	ssh_flight_put(flights, f);
+	return status;
+}
+EXPORT_SYMBOL_GPL(surface_sam_ssh_rqst_shared);
+
+
+static int surface_sam_ssh_ec_resume(struct sam_ssh_ec *ec)
+{
+	u8 buf[1] = { 0x00 };
+
+	struct surface_sam_ssh_rqst rqst = {
+		.tc  = 0x01,
+		.cid = 0x16,
+		.iid = 0x00,
+		.pri = SURFACE_SAM_PRIORITY_NORMAL,
+		.snc = 0x01,
+		.cdl = 0x00,
+		.pld = NULL,
+	};
+
+	struct surface_sam_ssh_buf result = {
+		result.cap = ARRAY_SIZE(buf),
+		result.len = 0,
+		result.data = buf,
+	};
+
+	int status = surface_sam_ssh_rqst_unlocked(ec, &rqst, &result);
+	if (status) {
+		return status;
+	}
+
+	if (buf[0] != 0x00) {
+		dev_warn(&ec->serdev->dev,
+		         "unexpected result while trying to resume EC: 0x%02x\n",
+			 buf[0]);
+	}
+
+	return 0;
+}
+
+static int surface_sam_ssh_ec_suspend(struct sam_ssh_ec *ec)
+{
+	u8 buf[1] = { 0x00 };
+
+	struct surface_sam_ssh_rqst rqst = {
+		.tc  = 0x01,
+		.cid = 0x15,
+		.iid = 0x00,
+		.pri = SURFACE_SAM_PRIORITY_NORMAL,
+		.snc = 0x01,
+		.cdl = 0x00,
+		.pld = NULL,
+	};
+
+	struct surface_sam_ssh_buf result = {
+		result.cap = ARRAY_SIZE(buf),
+		result.len = 0,
+		result.data = buf,
+	};
+
+	int status = surface_sam_ssh_rqst_unlocked(ec, &rqst, &result);
+	if (status) {
+		return status;
+	}
+
+	if (buf[0] != 0x00) {
+		dev_warn(&ec->serdev->dev,
+		         "unexpected result while trying to suspend EC: 0x%02x\n",
+			 buf[0]);
+	}
+
+	return 0;
+}
+
+
+inline static bool ssh_is_valid_syn(const u8 *ptr)
+{
+	return ptr[0] == 0xaa && ptr[1] == 0x55;
+}
+
+inline static bool ssh_is_valid_ter(const u8 *ptr)
+{
+	return ptr[0] == 0xff && ptr[1] == 0xff;
+}
+
+inline static bool ssh_is_valid_crc(const u8 *begin, const u8 *end)
+{
+	u16 crc = ssh_crc(begin, end - begin);
+	return (end[0] == (crc & 0xff)) && (end[1] == (crc >> 8));
+}
+
+/*
+ * Skip invalid data up to the next SYN following the start of the buffer,
+ * so that any valid message behind it is not lost. A trailing first SYN
+ * byte is kept, as its second byte may still be underway. Returns the
+ * number of bytes to discard. Must be called with the receiver lock held.
+ */
+static int ssh_receive_resync(struct sam_ssh_ec *ec, const u8 *buf, size_t size)
+{
+	const u8 *ptr = buf + 1;
+	const u8 *end = buf + size;
+	size_t n = size;
+
+	while (ptr < end && (ptr = memchr(ptr, 0xaa, end - ptr))) {
+		if (ptr + 1 == end || ptr[1] == 0x55) {
+			n = ptr - buf;
+			break;
+		}
+
+		ptr += 1;
+	}
+
+	ec->receiver.num_resync += 1;
+	ec->receiver.num_discarded += n;
+
+	return n;
+}
+
+
+static int ssh_event_pools_init(struct ssh_event_pool *pools)
+{
+	static const struct {
+		const char *name;
+		size_t pld_len;
+		int reserve;
+	} classes[SSH_NUM_EVENT_POOLS] = {
+		[SSH_EVENT_POOL_SMALL] = { "surface_sh_evt_s", SSH_EVENT_PLD_SMALL, SSH_EVENT_RESERVE_SMALL },
+		[SSH_EVENT_POOL_LARGE] = { "surface_sh_evt_l", SSH_EVENT_PLD_LARGE, SSH_EVENT_RESERVE_LARGE },
+	};
+	int i;
+
+	for (i = 0; i < SSH_NUM_EVENT_POOLS; i++) {
+		pools[i].pld_len = classes[i].pld_len;
+		pools[i].cache = kmem_cache_create(classes[i].name,
+				sizeof(struct ssh_event_work) + classes[i].pld_len,
+				0, 0, NULL);
+		if (!pools[i].cache)
+			goto err;
+
+		pools[i].pool = mempool_create_slab_pool(classes[i].reserve, pools[i].cache);
+		if (!pools[i].pool) {
+			kmem_cache_destroy(pools[i].cache);
+			goto err;
+		}
+	}
+
+	return 0;
+
+err:
+	while (--i >= 0) {
+		mempool_destroy(pools[i].pool);
+		kmem_cache_destroy(pools[i].cache);
+	}
+	return -ENOMEM;
+}
+
+static void ssh_event_pools_destroy(struct ssh_event_pool *pools)
+{
+	int i;
+
+	for (i = 0; i < SSH_NUM_EVENT_POOLS; i++) {
+		mempool_destroy(pools[i].pool);
+		kmem_cache_destroy(pools[i].cache);
+
+		pools[i].pool = NULL;
+		pools[i].cache = NULL;
+	}
+}
+
+/*
+ * Allocate a work item from the smallest pool fitting the payload. Called
+ * from the dispatcher, thus this must not sleep.
+ */
+static struct ssh_event_work *ssh_event_work_alloc(struct ssh_events *events, size_t pld_len)
+{
+	struct ssh_event_work *work;
+	int i;
+
+	for (i = 0; i < SSH_NUM_EVENT_POOLS; i++) {
+		if (pld_len > events->pool[i].pld_len)
+			continue;
+
+		work = mempool_alloc(events->pool[i].pool, GFP_ATOMIC);
+		if (!work)
+			return NULL;
+
+		memset(work, 0, sizeof(*work) + pld_len);
+		work->pool = events->pool[i].pool;
+		work->pld_cap = events->pool[i].pld_len;
+		return work;
+	}
+
+	return NULL;
+}
+
+inline static void ssh_event_work_free(struct ssh_event_work *work)
+{
+	mempool_free(work, work->pool);
+}
+
+static void surface_sam_ssh_event_work_evt_handler(struct work_struct *_work)
+{
+	struct delayed_work *dwork = (struct delayed_work *)_work;
+	struct ssh_event_work *work;
+	struct surface_sam_ssh_event *event;
+	struct sam_ssh_ec *ec;
+	struct device *dev;
+	struct ssh_event_handler *h;
+
+	int status = 0;
+
+	work = container_of(dwork, struct ssh_event_work, work_evt);
+	event = &work->event;
+	h = work->handler;
+	ec = work->ec;
+	dev = &ec->serdev->dev;
+
+	/*
+	 * During handler removal or driver release, we ensure every event gets
+	 * handled before the handler is freed. Thus the handler obtained on
+	 * dispatch is guaranteed to be valid at least until this function
+	 * returns.
+	 */
+
+	if (h) {
+		unsigned long flags;
+
+		// once started, no further events may be merged into this one
+		spin_lock_irqsave(&h->lock, flags);
+		if (!list_empty(&work->node))
+			list_del_init(&work->node);
+		spin_unlock_irqrestore(&h->lock, flags);
+
+		// earlier immediate events of this handler must be handled first
+		if (work->rt_diverted)
+			wait_event(ec->events.waitq, !atomic_read(&h->rt_queued));
+
+		status = h->handler(event, h->data);
+
+		if (work->rt_diverted)
+			atomic_dec(&h->rt_diverted);
+
+		if (work->rt_queued && atomic_dec_and_test(&h->rt_queued)
+		    && atomic_read(&h->rt_diverted))
+			wake_up_all(&ec->events.waitq);
+	} else {
+		dev_warn(dev, SSH_EVENT_TAG "unhandled event (rqid: %04x)\n", event->rqid);
+	}
+
+	if (status) {
+		dev_err(dev, SSH_EVENT_TAG "error handling event: %d\n", status);
+	}
+
+	ssh_event_work_free(work);
+
+	if (h && atomic_dec_and_test(&h->pending)) {
+		wake_up_all(&ec->events.waitq);
+	}
+}
+
+/*
+ * Hand an immediate event over to the real-time thread. Must only be called
+ * from the dispatcher. Returns false if the ring is full.
+ */
+static bool ssh_event_rt_push(struct ssh_events *events, struct ssh_event_work *work)
+{
+	unsigned int head = events->rt.head;
+	unsigned int tail = smp_load_acquire(&events->rt.tail);
+
+	if (head - tail >= SSH_EVENT_RT_RING_LEN)
+		return false;
+
+	events->rt.buf[head & (SSH_EVENT_RT_RING_LEN - 1)] = work;
+	smp_store_release(&events->rt.head, head + 1);
+
+	return true;
+}
+
+static struct ssh_event_work *ssh_event_rt_pop(struct ssh_events *events)
+{
+	unsigned int tail = events->rt.tail;
+	unsigned int head = smp_load_acquire(&events->rt.head);
+	struct ssh_event_work *work;
+
+	if (head == tail)
+		return NULL;
+
+	work = events->rt.buf[tail & (SSH_EVENT_RT_RING_LEN - 1)];
+	smp_store_release(&events->rt.tail, tail + 1);
+
+	return work;
+}
+
+static int ssh_event_rt_thread_fn(void *data)
+{
+	struct sam_ssh_ec *ec = data;
+	struct ssh_event_work *work;
+
+	while (true) {
+		set_current_state(TASK_INTERRUPTIBLE);
+
+		if (smp_load_acquire(&ec->events.rt.head) == ec->events.rt.tail) {
+			if (kthread_should_stop())
+				break;
+
+			schedule();
+		}
+
+		__set_current_state(TASK_RUNNING);
+
+		while ((work = ssh_event_rt_pop(&ec->events)))
+			surface_sam_ssh_event_work_evt_handler(&work->work_evt.work);
+	}
+
+	__set_current_state(TASK_RUNNING);
+	return 0;
+}
+
+static struct task_struct *ssh_event_rt_thread_create(struct sam_ssh_ec *ec)
+{
+	struct sched_param param = { .sched_priority = MAX_USER_RT_PRIO / 2 };
+	struct task_struct *thread;
+
+	thread = kthread_create(ssh_event_rt_thread_fn, ec, "surface_sh_evtd");
+	if (IS_ERR(thread))
+		return thread;
+
+	sched_setscheduler_nocheck(thread, SCHED_FIFO, &param);
+	wake_up_process(thread);
+
+	return thread;
+}
 
-	// write command in buffer, we may need it multiple times
-	ssh_write_msg_cmd(ec, rqst);
-	ssh_receiver_restart(ec, rqst);
+/*
+ * Try to merge a delayed event into a not yet started event of the same
+ * handler with the same (tc, cid, iid). Returns true if the event has been
+ * merged. The payload is copied, so the event may be backed by the frame.
+ */
+static bool ssh_event_coalesce(struct ssh_event_handler *h,
+			       const struct surface_sam_ssh_event *event,
+			       unsigned long delay)
+{
+	struct ssh_event_work *p;
+	unsigned long flags;
+	bool merged = false;
+	u8 mode;
 
-	// send command, try to get an ack response
-	for (try = 0; try < SSH_NUM_RETRY; try++) {
-		status = ssh_writer_flush(ec);
-		if (status) {
-			goto out;
-		}
+	mode = READ_ONCE(h->coalesce);
+	if (mode == SURFACE_SAM_SSH_EVENT_COALESCE_NONE)
+		return false;
+
+	spin_lock_irqsave(&h->lock, flags);
+	list_for_each_entry(p, &h->delayed, node) {
+		if (p->event.tc != event->tc || p->event.cid != event->cid || p->event.iid != event->iid)
+			continue;
 
-		rem = wait_for_completion_timeout(&ec->receiver.signal, SSH_READ_TIMEOUT);
-		if (rem) {
-			// completion assures valid packet, thus ignore returned length
-			(void) !kfifo_out(&ec->receiver.fifo, &packet, sizeof(packet));
+		if (event->len > p->pld_cap)
+			break;
 
-			if (packet.type == SSH_FRAME_TYPE_ACK) {
+		if (mode == SURFACE_SAM_SSH_EVENT_COALESCE_EXTEND) {
+			// don't re-queue the work if it is already running
+			if (!cancel_delayed_work(&p->work_evt))
 				break;
-			}
-		}
-	}
 
-	// check if we ran out of tries?
-	if (try >= SSH_NUM_RETRY) {
-		dev_err(dev, SSH_RQST_TAG "communication failed %d times, giving up\n", try);
-		status = -EIO;
-		goto out;
-	}
+			queue_delayed_work(h->queue, &p->work_evt, delay);
+		}
 
-	ec->counter.seq  += 1;
-	ec->counter.rqid += 1;
+		p->event.pri           = event->pri;
+		p->event.len           = event->len;
+		p->event.rx_time       = event->rx_time;
+		p->event.dispatch_time = event->dispatch_time;
+		memcpy(p->event.pld, event->pld, event->len);
 
-	// get command response/payload
-	if (rqst->snc && result) {
-		rem = wait_for_completion_timeout(&ec->receiver.signal, SSH_READ_TIMEOUT);
-		if (rem) {
-			// completion assures valid packet, thus ignore returned length
-			(void) !kfifo_out(&ec->receiver.fifo, &packet, sizeof(packet));
+		merged = true;
+		break;
+	}
+	spin_unlock_irqrestore(&h->lock, flags);
 
-			if (result->cap < packet.len) {
-				status = -EINVAL;
-				goto out;
-			}
+	return merged;
+}
 
-			// completion assures valid packet, thus ignore returned length
-			(void) !kfifo_out(&ec->receiver.fifo, result->data, packet.len);
-			result->len = packet.len;
-		} else {
-			dev_err(dev, SSH_RQST_TAG "communication timed out\n");
-			status = -EIO;
-			goto out;
-		}
+/*
+ * Make a delayed event available for merging, if coalescing is enabled. Must
+ * be called before the event is queued.
+ */
+static void ssh_event_delayed_add(struct ssh_event_handler *h, struct ssh_event_work *work)
+{
+	unsigned long flags;
 
-		// send ACK
-		if (packet.type == SSH_FRAME_TYPE_CMD) {
-			ssh_write_msg_ack(ec, packet.seq);
-			status = ssh_writer_flush(ec);
-			if (status) {
-				goto out;
-			}
-		}
-	}
+	if (READ_ONCE(h->coalesce) == SURFACE_SAM_SSH_EVENT_COALESCE_NONE)
+		return;
 
-out:
-	ssh_receiver_discard(ec);
-	return status;
+	spin_lock_irqsave(&h->lock, flags);
+	list_add_tail(&work->node, &h->delayed);
+	spin_unlock_irqrestore(&h->lock, flags);
 }
 
-int surface_sam_ssh_rqst(const struct surface_sam_ssh_rqst *rqst, struct surface_sam_ssh_buf *result)
+/*
+ * Check whether an event frame has been received recently and record it
+ * otherwise. The frame is identified by its SEQ and payload CRC. Must only be
+ * called from the dispatcher.
+ */
+static bool ssh_event_is_duplicate(struct ssh_event_seqwin *win, u8 seq, u16 crc, ktime_t now)
 {
-	struct sam_ssh_ec *ec;
-	int status;
+	int i;
 
-	ec = surface_sam_ssh_acquire_init();
-	if (!ec) {
-		printk(KERN_WARNING SSH_RQST_TAG_FULL "embedded controller is uninitialized\n");
-		return -ENXIO;
-	}
+	for (i = 0; i < SSH_EVENT_SEQ_WINDOW; i++) {
+		if (win->entry[i].seq != seq || win->entry[i].crc != crc)
+			continue;
 
-	if (ec->state == SSH_EC_SUSPENDED) {
-		dev_warn(&ec->serdev->dev, SSH_RQST_TAG "embedded controller is suspended\n");
+		// zero time marks unused entries
+		if (win->entry[i].time == 0)
+			continue;
 
-		surface_sam_ssh_release(ec);
-		return -EPERM;
+		if (ktime_ms_delta(now, win->entry[i].time) < SSH_EVENT_DUP_TIMEOUT_MS)
+			return true;
 	}
 
-	status = surface_sam_ssh_rqst_unlocked(ec, rqst, result);
+	win->entry[win->next].seq = seq;
+	win->entry[win->next].crc = crc;
+	win->entry[win->next].time = now;
+	win->next = (win->next + 1) % SSH_EVENT_SEQ_WINDOW;
 
-	surface_sam_ssh_release(ec);
-	return status;
+	return false;
 }
-EXPORT_SYMBOL_GPL(surface_sam_ssh_rqst);
 
-
-static int surface_sam_ssh_ec_resume(struct sam_ssh_ec *ec)
+/*
+ * Take a token from the bucket of the event source. Returns false if the
+ * source exceeds its rate limit. Tokens are kept in units of 1/NSEC_PER_SEC,
+ * so that refilling does not require any divisions. Must only be called from
+ * the dispatcher.
+ */
+static bool ssh_event_ratelimit(struct ssh_event_bucket *b, ktime_t now)
 {
-	u8 buf[1] = { 0x00 };
+	unsigned int rate = READ_ONCE(b->rate);
+	unsigned int burst = READ_ONCE(b->burst);
+	u64 cap, elapsed;
 
-	struct surface_sam_ssh_rqst rqst = {
-		.tc  = 0x01,
-		.cid = 0x16,
-		.iid = 0x00,
-		.pri = SURFACE_SAM_PRIORITY_NORMAL,
-		.snc = 0x01,
-		.cdl = 0x00,
-		.pld = NULL,
-	};
+	if (!rate)
+		rate = min_t(unsigned int, READ_ONCE(event_rate_limit), SSH_EVENT_RATE_MAX);
+	if (!burst)
+		burst = clamp_t(unsigned int, READ_ONCE(event_rate_burst), 1, SSH_EVENT_BURST_MAX);
 
-	struct surface_sam_ssh_buf result = {
-		result.cap = ARRAY_SIZE(buf),
-		result.len = 0,
-		result.data = buf,
-	};
+	if (!rate)
+		return true;
 
-	int status = surface_sam_ssh_rqst_unlocked(ec, &rqst, &result);
-	if (status) {
-		return status;
-	}
+	// after burst seconds, the bucket is full for any rate
+	cap = (u64)burst * NSEC_PER_SEC;
+	elapsed = min_t(u64, ktime_to_ns(ktime_sub(now, b->last)), cap);
 
-	if (buf[0] != 0x00) {
-		dev_warn(&ec->serdev->dev,
-		         "unexpected result while trying to resume EC: 0x%02x\n",
-			 buf[0]);
+	b->last = now;
+	b->tokens = min_t(u64, b->tokens + elapsed * rate, cap);
+
+	if (b->tokens < NSEC_PER_SEC) {
+		WRITE_ONCE(b->num_dropped, b->num_dropped + 1);
+		return false;
 	}
 
-	return 0;
+	b->tokens -= NSEC_PER_SEC;
+	return true;
 }
 
-static int surface_sam_ssh_ec_suspend(struct sam_ssh_ec *ec)
+/*
+ * Queue an ACK for the message with the given SEQ. ACKs are collected and
+ * sent together by the ACK work, or along with the next request frames,
+ * whichever comes first.
+ */
+static void ssh_receive_queue_ack(struct sam_ssh_ec *ec, u8 seq)
 {
-	u8 buf[1] = { 0x00 };
-
-	struct surface_sam_ssh_rqst rqst = {
-		.tc  = 0x01,
-		.cid = 0x15,
-		.iid = 0x00,
-		.pri = SURFACE_SAM_PRIORITY_NORMAL,
-		.snc = 0x01,
-		.cdl = 0x00,
-		.pld = NULL,
-	};
+	struct ssh_receiver *rcv = &ec->receiver;
+	unsigned long flags;
 
-	struct surface_sam_ssh_buf result = {
-		result.cap = ARRAY_SIZE(buf),
-		result.len = 0,
-		result.data = buf,
-	};
+	spin_lock_irqsave(&rcv->lock, flags);
+	if (kfifo_avail(&rcv->fifo) < sizeof(seq)) {
+		spin_unlock_irqrestore(&rcv->lock, flags);
 
-	int status = surface_sam_ssh_rqst_unlocked(ec, &rqst, &result);
-	if (status) {
-		return status;
+		dev_warn(&ec->serdev->dev, SSH_RECV_TAG
+			 "dropping ACK: not enough space in fifo\n");
+		return;
 	}
 
-	if (buf[0] != 0x00) {
-		dev_warn(&ec->serdev->dev,
-		         "unexpected result while trying to suspend EC: 0x%02x\n",
-			 buf[0]);
-	}
+	kfifo_in(&rcv->fifo, &seq, sizeof(seq));
+	spin_unlock_irqrestore(&rcv->lock, flags);
 
-	return 0;
+	queue_work(ec->events.queue_ack, &ec->rtl.ack_work);
 }
 
-
-inline static bool ssh_is_valid_syn(const u8 *ptr)
+inline static bool ssh_event_handler_matches(const struct ssh_event_handler *h,
+					     const struct surface_sam_ssh_event *event)
 {
-	return ptr[0] == 0xaa && ptr[1] == 0x55;
-}
+	if (h->tc != SURFACE_SAM_SSH_EVENT_TC_ANY && h->tc != event->tc)
+		return false;
 
-inline static bool ssh_is_valid_ter(const u8 *ptr)
-{
-	return ptr[0] == 0xff && ptr[1] == 0xff;
+	return test_bit(event->cid, h->cid_mask);
 }
 
-inline static bool ssh_is_valid_crc(const u8 *begin, const u8 *end)
+/*
+ * Hand an event over to a single handler, or to the queue for unhandled
+ * events if h is NULL. The payload of the event is still in the frame. The
+ * rate limit of the source is checked at most once per event, admit holds
+ * the result (negative if it has not been checked yet).
+ */
+static void ssh_event_deliver(struct sam_ssh_ec *ec, struct ssh_event_handler *h,
+			      struct surface_sam_ssh_event *event, int *admit)
 {
-	u16 crc = ssh_crc(begin, end - begin);
-	return (end[0] == (crc & 0xff)) && (end[1] == (crc >> 8));
-}
+	struct device *dev = &ec->serdev->dev;
+	struct ssh_event_work *work;
+	unsigned long delay;
+	bool exempt;
 
+	delay = h ? h->delay(event, h->data) : 0;
 
-static int surface_sam_ssh_send_ack(struct sam_ssh_ec *ec, u8 seq)
-{
-	int status;
-	u8 buf[SSH_MSG_LEN_CTRL];
-	u16 crc;
+	// merging doesn't take up any resources, thus isn't rate limited
+	if (h && delay && delay != SURFACE_SAM_SSH_EVENT_IMMEDIATE
+	    && ssh_event_coalesce(h, event, delay)) {
+		atomic_inc(&ec->events.num_merged);
+		return;
+	}
 
-	buf[0] = 0xaa;
-	buf[1] = 0x55;
-	buf[2] = 0x40;
-	buf[3] = 0x00;
-	buf[4] = 0x00;
-	buf[5] = seq;
+	/*
+	 * High-priority handlers (e.g. keyboard input) must not lose events
+	 * to the default limit, a dropped key-up would leave a key stuck. A
+	 * limit set explicitly for the source applies to them as well.
+	 */
+	exempt = h && h->high_pri && !READ_ONCE(ec->events.bucket[event->rqid - 1].rate);
+
+	if (!exempt && *admit < 0) {
+		*admit = ssh_event_ratelimit(&ec->events.bucket[event->rqid - 1],
+					     event->dispatch_time);
+		if (!*admit)
+			dev_dbg(dev, SSH_EVENT_TAG "rate limit exceeded, dropping event (rqid: %04x)\n",
+				event->rqid);
+	}
 
-	crc = ssh_crc(buf + SSH_FRAME_OFFS_CTRL, SSH_BYTELEN_CTRL);
-	buf[6] = crc & 0xff;
-	buf[7] = crc >> 8;
+	if (!exempt && !*admit)
+		return;
 
-	buf[8] = 0xff;
-	buf[9] = 0xff;
+	work = ssh_event_work_alloc(&ec->events, event->len);
+	if (!work) {
+		dev_warn(dev, SSH_EVENT_TAG "failed to allocate memory, dropping event\n");
+		return;
+	}
 
-	dev_dbg(&ec->serdev->dev, "sending message\n");
-	print_hex_dump_debug("send: ", DUMP_PREFIX_OFFSET, 16, 1,
-	                     buf, SSH_MSG_LEN_CTRL, false);
+	work->ec = ec;
+	work->event = *event;
+	work->event.pld = ((u8*) work) + sizeof(struct ssh_event_work);
+	work->rt_queued = false;
+	work->rt_diverted = false;
+	INIT_LIST_HEAD(&work->node);
 
-	status = serdev_device_write(ec->serdev, buf, SSH_MSG_LEN_CTRL, SSH_WRITE_TIMEOUT);
-	return status >= 0 ? 0 : status;
-}
+	memcpy(work->event.pld, event->pld, event->len);
 
-static void surface_sam_ssh_event_work_ack_handler(struct work_struct *_work)
-{
-	struct surface_sam_ssh_event *event;
-	struct ssh_event_work *work;
-	struct sam_ssh_ec *ec;
-	struct device *dev;
-	int status;
+	if (h) {
+		atomic_inc(&h->pending);
+		work->handler = h;
+	}
 
-	work = container_of(_work, struct ssh_event_work, work_ack);
-	event = &work->event;
-	ec = work->ec;
-	dev = &ec->serdev->dev;
+	// immediate execution for high priority events (e.g. keyboard)
+	if (delay == SURFACE_SAM_SSH_EVENT_IMMEDIATE && !ec->events.rt.thread) {
+		surface_sam_ssh_event_work_evt_handler(&work->work_evt.work);
+		return;
+	}
 
-	// make sure we load a fresh ec state
-	smp_mb();
+	// immediate events only use the ring while none have been diverted
+	if (delay == SURFACE_SAM_SSH_EVENT_IMMEDIATE && !atomic_read(&h->rt_diverted)) {
+		work->rt_queued = true;
+		atomic_inc(&h->rt_queued);
 
-	if (ec->state == SSH_EC_INITIALIZED) {
-		status = surface_sam_ssh_send_ack(ec, work->seq);
-		if (status) {
-			dev_err(dev, SSH_EVENT_TAG "failed to send ACK: %d\n", status);
+		if (ssh_event_rt_push(&ec->events, work)) {
+			wake_up_process(ec->events.rt.thread);
+			return;
 		}
+
+		work->rt_queued = false;
+		atomic_dec(&h->rt_queued);
 	}
 
-	if (refcount_dec_and_test(&work->refcount)) {
-		kfree(work);
+	// if the real-time ring is full (or has been), fall back to the workqueue
+	if (delay == SURFACE_SAM_SSH_EVENT_IMMEDIATE) {
+		work->rt_diverted = true;
+		atomic_inc(&h->rt_diverted);
+		delay = 0;
 	}
-}
 
-static void surface_sam_ssh_event_work_evt_handler(struct work_struct *_work)
-{
-	struct delayed_work *dwork = (struct delayed_work *)_work;
-	struct ssh_event_work *work;
-	struct surface_sam_ssh_event *event;
-	struct sam_ssh_ec *ec;
-	struct device *dev;
-	unsigned long flags;
+	INIT_DELAYED_WORK(&work->work_evt, surface_sam_ssh_event_work_evt_handler);
 
-	surface_sam_ssh_event_handler_fn handler;
-	void *handler_data;
+	if (h && delay)
+		ssh_event_delayed_add(h, work);
 
-	int status = 0;
+	queue_delayed_work(h ? h->queue : ec->events.queue_evt, &work->work_evt, delay);
+}
 
-	work = container_of(dwork, struct ssh_event_work, work_evt);
-	event = &work->event;
-	ec = work->ec;
-	dev = &ec->serdev->dev;
+static void ssh_handle_event(struct sam_ssh_ec *ec, const u8 *buf, ktime_t rx_time)
+{
+	struct device *dev = &ec->serdev->dev;
+	const struct ssh_frame_ctrl *ctrl;
+	const struct ssh_frame_cmd *cmd;
+	struct surface_sam_ssh_event event;
+	struct ssh_event_handler *h;
+	bool handled = false;
+	int admit = -1;
+
+	ctrl = (const struct ssh_frame_ctrl *)(buf + SSH_FRAME_OFFS_CTRL);
+	cmd  = (const struct ssh_frame_cmd  *)(buf + SSH_FRAME_OFFS_CMD);
 
-	spin_lock_irqsave(&ec->events.lock, flags);
-	handler       = ec->events.handler[event->rqid - 1].handler;
-	handler_data  = ec->events.handler[event->rqid - 1].data;
-	spin_unlock_irqrestore(&ec->events.lock, flags);
+	// the payload stays in the frame until the event has been accepted
+	event.rqid = (cmd->rqid_hi << 8) | cmd->rqid_lo;
+	event.tc   = cmd->tc;
+	event.cid  = cmd->cid;
+	event.iid  = cmd->iid;
+	event.pri  = cmd->pri_in;
+	event.len  = ctrl->len - SSH_BYTELEN_CMDFRAME;
+	event.pld  = (u8 *)(buf + SSH_FRAME_OFFS_CMD_PLD);
+	event.rx_time       = rx_time;
+	event.dispatch_time = ktime_get();
+	// queue ACK for if required, also for merged and dropped events
+	if (ctrl->type == SSH_FRAME_TYPE_CMD) {
+		ssh_receive_queue_ack(ec, ctrl->seq);
+	}
 
 	/*
-	 * During handler removal or driver release, we ensure every event gets
-	 * handled before return of that function. Thus a handler obtained here is
-	 * guaranteed to be valid at least until this function returns.
+	 * The EC re-sends events for which our ACK came too late. Only frames
+	 * that require an ACK may be re-sent.
 	 */
+	if (ctrl->type == SSH_FRAME_TYPE_CMD && ssh_event_is_duplicate(
+			&ec->events.seen[event.rqid - 1], ctrl->seq,
+			get_unaligned_le16(buf + SSH_FRAME_OFFS_CMD + ctrl->len),
+			event.rx_time)) {
+		dev_dbg(dev, SSH_EVENT_TAG "dropping duplicate event (rqid: %04x, seq: %02x)\n",
+			event.rqid, ctrl->seq);
+		WRITE_ONCE(ec->events.num_duplicate, ec->events.num_duplicate + 1);
+		return;
+	}
 
-	if (handler) {
-		status = handler(event, handler_data);
-	} else {
-		dev_warn(dev, SSH_EVENT_TAG "unhandled event (rqid: %04x)\n", event->rqid);
+	rcu_read_lock();
+	list_for_each_entry_rcu(h, &ec->events.handlers[event.rqid - 1], node) {
+		if (!ssh_event_handler_matches(h, &event))
+			continue;
+
+		ssh_event_deliver(ec, h, &event, &admit);
+		handled = true;
 	}
 
-	if (status) {
-		dev_err(dev, SSH_EVENT_TAG "error handling event: %d\n", status);
+	/* Note:
+	 * We need to check the handler here: This may have never been set as we
+	 * can't guarantee that events only occur when they have been enabled.
+	 */
+	if (!handled)
+		ssh_event_deliver(ec, NULL, &event, &admit);
+	rcu_read_unlock();
+}
+
+/*
+ * Store a validated message in the frame ring and schedule the dispatcher.
+ * Must be called with the receiver lock held. If the ring is full, the
+ * message is dropped: The EC re-sends unacknowledged messages and requests
+ * are re-sent on timeout.
+ */
+static void ssh_receive_push_frame(struct sam_ssh_ec *ec, const u8 *buf, size_t len)
+{
+	struct ssh_receiver *rcv = &ec->receiver;
+	unsigned int head = rcv->frames.head;
+	unsigned int tail = smp_load_acquire(&rcv->frames.tail);
+	struct ssh_frame_slot *slot;
+
+	if (head - tail >= SSH_FRAME_RING_LEN) {
+		dev_warn(&ec->serdev->dev, SSH_RECV_TAG
+			 "dropping message: frame ring full\n");
+		rcv->frames.num_dropped += 1;
+		return;
 	}
 
-	if (refcount_dec_and_test(&work->refcount)) {
-		kfree(work);
+	slot = &rcv->frames.slot[head & (SSH_FRAME_RING_LEN - 1)];
+	slot->rx_time = rcv->rx_time;
+	slot->len = len;
+	memcpy(slot->data, buf, len);
+
+	smp_store_release(&rcv->frames.head, head + 1);
+	rcv->frames.num_extracted += 1;
+
+	tasklet_schedule(&rcv->dispatch);
+}
+
+static void ssh_dispatch_ctrl(struct sam_ssh_ec *ec, const u8 *buf)
+{
+	const struct ssh_frame_ctrl *ctrl;
+
+	ctrl = (const struct ssh_frame_ctrl *)(buf + SSH_FRAME_OFFS_CTRL);
+
+	// check if it is for one of our requests
+	if (!ssh_rtl_handle_ctrl(ec, ctrl)) {
+		dev_err(&ec->serdev->dev, SSH_RECV_TAG "discarding message: ctrl does not match\n");
 	}
 }
 
-static void ssh_handle_event(struct sam_ssh_ec *ec, const u8 *buf)
+static void ssh_dispatch_cmd(struct sam_ssh_ec *ec, const u8 *buf, ktime_t rx_time)
 {
-	struct device *dev = &ec->serdev->dev;
 	const struct ssh_frame_ctrl *ctrl;
 	const struct ssh_frame_cmd *cmd;
-	struct ssh_event_work *work;
-	unsigned long flags;
-	u16 pld_len;
-
-	surface_sam_ssh_event_handler_delay delay_fn;
-	void *handler_data;
-	unsigned long delay;
+	u16 rqid;
 
 	ctrl = (const struct ssh_frame_ctrl *)(buf + SSH_FRAME_OFFS_CTRL);
 	cmd  = (const struct ssh_frame_cmd  *)(buf + SSH_FRAME_OFFS_CMD);
+	rqid = (cmd->rqid_hi << 8) | cmd->rqid_lo;
 
-	pld_len = ctrl->len - SSH_BYTELEN_CMDFRAME;
-
-	work = kzalloc(sizeof(struct ssh_event_work) + pld_len, GFP_ATOMIC);
-	if (!work) {
-		dev_warn(dev, SSH_EVENT_TAG "failed to allocate memory, dropping event\n");
+	// check if we received an event notification
+	if (sam_rqid_is_event(rqid)) {
+		ssh_handle_event(ec, buf, rx_time);
 		return;
 	}
 
-	refcount_set(&work->refcount, 1);
-	work->ec         = ec;
-	work->seq        = ctrl->seq;
-	work->event.rqid = (cmd->rqid_hi << 8) | cmd->rqid_lo;
-	work->event.tc   = cmd->tc;
-	work->event.cid  = cmd->cid;
-	work->event.iid  = cmd->iid;
-	work->event.pri  = cmd->pri_in;
-	work->event.len  = pld_len;
-	work->event.pld  = ((u8*) work) + sizeof(struct ssh_event_work);
-
-	memcpy(work->event.pld, buf + SSH_FRAME_OFFS_CMD_PLD, pld_len);
+	// we have a response, hand it over to its request
+	if (!ssh_rtl_handle_response(ec, rqid, buf + SSH_FRAME_OFFS_CMD_PLD,
+				     ctrl->len - SSH_BYTELEN_CMDFRAME)) {
+		dev_dbg(&ec->serdev->dev, SSH_RECV_TAG "discarding response: no matching request\n");
+	}
 
-	// queue ACK for if required
+	// ACK the response, even if we discarded it, to avoid re-transmission
 	if (ctrl->type == SSH_FRAME_TYPE_CMD) {
-		refcount_set(&work->refcount, 2);
-		INIT_WORK(&work->work_ack, surface_sam_ssh_event_work_ack_handler);
-		queue_work(ec->events.queue_ack, &work->work_ack);
+		ssh_receive_queue_ack(ec, ctrl->seq);
 	}
+}
+
+/*
+ * Second stage of the receiver: Dispatch the messages extracted by the
+ * first stage. Runs as tasklet, i.e. never concurrently with itself.
+ */
+static void ssh_receive_dispatch_fn(unsigned long data)
+{
+	struct sam_ssh_ec *ec = (struct sam_ssh_ec *)data;
+	struct ssh_receiver *rcv = &ec->receiver;
+	struct ssh_frame_slot *slot;
+	const struct ssh_frame_ctrl *ctrl;
+	unsigned int head, tail, n;
 
-	spin_lock_irqsave(&ec->events.lock, flags);
-	handler_data = ec->events.handler[work->event.rqid - 1].data;
-	delay_fn = ec->events.handler[work->event.rqid - 1].delay;
+	for (n = 0; n < SSH_DISPATCH_BUDGET; n++) {
+		tail = rcv->frames.tail;
+		head = smp_load_acquire(&rcv->frames.head);
+		if (head == tail)
+			return;
 
-	/* Note:
-	 * We need to check delay_fn here: This may have never been set as we
-	 * can't guarantee that events only occur when they have been enabled.
-	 */
-	delay = delay_fn ? delay_fn(&work->event, handler_data) : 0;
-	spin_unlock_irqrestore(&ec->events.lock, flags);
+		slot = &rcv->frames.slot[tail & (SSH_FRAME_RING_LEN - 1)];
+		ctrl = (const struct ssh_frame_ctrl *)(slot->data + SSH_FRAME_OFFS_CTRL);
 
-	// immediate execution for high priority events (e.g. keyboard)
-	if (delay == SURFACE_SAM_SSH_EVENT_IMMEDIATE) {
-		surface_sam_ssh_event_work_evt_handler(&work->work_evt.work);
-	} else {
-		INIT_DELAYED_WORK(&work->work_evt, surface_sam_ssh_event_work_evt_handler);
-		queue_delayed_work(ec->events.queue_evt, &work->work_evt, delay);
+		if (ctrl->type == SSH_FRAME_TYPE_ACK || ctrl->type == SSH_FRAME_TYPE_RETRY)
+			ssh_dispatch_ctrl(ec, slot->data);
+		else
+			ssh_dispatch_cmd(ec, slot->data, slot->rx_time);
+
+		smp_store_release(&rcv->frames.tail, tail + 1);
+		rcv->frames.num_dispatched += 1;
 	}
+
+	// out of budget, give others a chance and continue later
+	tasklet_schedule(&rcv->dispatch);
 }
 
 static int ssh_receive_msg_ctrl(struct sam_ssh_ec *ec, const u8 *buf, size_t size)
 {
 	struct device *dev = &ec->serdev->dev;
-	struct ssh_receiver *rcv = &ec->receiver;
 	const struct ssh_frame_ctrl *ctrl;
-	struct ssh_fifo_packet packet;
 
 	const u8 *ctrl_begin = buf + SSH_FRAME_OFFS_CTRL;
 	const u8 *ctrl_end   = buf + SSH_FRAME_OFFS_CTRL_CRC;
@@ -987,7 +3510,7 @@ static int ssh_receive_msg_ctrl(struct sam_ssh_ec *ec, const u8 *buf, size_t siz
 	// validate TERM
 	if (!ssh_is_valid_ter(buf + SSH_FRAME_OFFS_TERM)) {
 		dev_err(dev, SSH_RECV_TAG "invalid end of message\n");
-		return size;			// discard everything
+		return ssh_receive_resync(ec, buf, size);	// skip to next SYN
 	}
 
 	// validate CRC
@@ -996,44 +3519,9 @@ static int ssh_receive_msg_ctrl(struct sam_ssh_ec *ec, const u8 *buf, size_t siz
 		return SSH_MSG_LEN_CTRL;	// only discard message
 	}
 
-	// check if we expect the message
-	if (rcv->state != SSH_RCV_CONTROL) {
-		dev_err(dev, SSH_RECV_TAG "discarding message: ctrl not expected\n");
-		return SSH_MSG_LEN_CTRL;	// discard message
-	}
-
-	// check if it is for our request
-	if (ctrl->type == SSH_FRAME_TYPE_ACK && ctrl->seq != rcv->expect.seq) {
-		dev_err(dev, SSH_RECV_TAG "discarding message: ack does not match\n");
-		return SSH_MSG_LEN_CTRL;	// discard message
-	}
-
-	// we now have a valid & expected ACK/RETRY message
+	// we now have a valid ACK/RETRY message
 	dev_dbg(dev, SSH_RECV_TAG "valid control message received (type: 0x%02x)\n", ctrl->type);
-
-	packet.type = ctrl->type;
-	packet.seq  = ctrl->seq;
-	packet.len  = 0;
-
-	if (kfifo_avail(&rcv->fifo) >= sizeof(packet)) {
-		kfifo_in(&rcv->fifo, (u8 *) &packet, sizeof(packet));
-
-	} else {
-		dev_warn(dev, SSH_RECV_TAG
-			 "dropping frame: not enough space in fifo (type = %d)\n",
-			 ctrl->type);
-
-		return SSH_MSG_LEN_CTRL;	// discard message
-	}
-
-	// update decoder state
-	if (ctrl->type == SSH_FRAME_TYPE_ACK) {
-		rcv->state = rcv->expect.pld
-			? SSH_RCV_COMMAND
-			: SSH_RCV_DISCARD;
-	}
-
-	complete(&rcv->signal);
+	ssh_receive_push_frame(ec, buf, SSH_MSG_LEN_CTRL);
 	return SSH_MSG_LEN_CTRL;		// handled message
 }
 
@@ -1043,7 +3531,6 @@ static int ssh_receive_msg_cmd(struct sam_ssh_ec *ec, const u8 *buf, size_t size
 	struct ssh_receiver *rcv = &ec->receiver;
 	const struct ssh_frame_ctrl *ctrl;
 	const struct ssh_frame_cmd *cmd;
-	struct ssh_fifo_packet packet;
 
 	const u8 *ctrl_begin     = buf + SSH_FRAME_OFFS_CTRL;
 	const u8 *ctrl_end       = buf + SSH_FRAME_OFFS_CTRL_CRC;
@@ -1066,9 +3553,9 @@ static int ssh_receive_msg_cmd(struct sam_ssh_ec *ec, const u8 *buf, size_t size
 		dev_err(dev, SSH_RECV_TAG "invalid checksum (cmd-ctrl)\n");
 		/*
 		 * We can't be sure here if length is valid, thus
-		 * discard everything.
+		 * discard everything up to the next SYN.
 		 */
-		return size;
+		return ssh_receive_resync(ec, buf, size);
 	}
 
 	// actual length check (ctrl->len contains command-frame but not crc)
@@ -1082,13 +3569,18 @@ static int ssh_receive_msg_cmd(struct sam_ssh_ec *ec, const u8 *buf, size_t size
 	// validate command-frame type
 	if (cmd->type != SSH_FRAME_TYPE_CMD) {
 		dev_err(dev, SSH_RECV_TAG "expected command frame type but got 0x%02x\n", cmd->type);
-		return size;			// discard everything
+		return ssh_receive_resync(ec, buf, size);	// skip to next SYN
 	}
 
 	// validate command-frame CRC
 	if (!ssh_is_valid_crc(cmd_begin, cmd_end)) {
 		dev_err(dev, SSH_RECV_TAG "invalid checksum (cmd-pld)\n");
 
+		// request re-transmission instead of waiting for the timeout
+		rcv->num_nak += 1;
+		rcv->nak_pending = true;
+		queue_work(ec->events.queue_ack, &ec->rtl.ack_work);
+
 		/*
 		 * The message length is provided in the control frame. As we
 		 * already validated that, we can be sure here that it's
@@ -1097,46 +3589,9 @@ static int ssh_receive_msg_cmd(struct sam_ssh_ec *ec, const u8 *buf, size_t size
 		return msg_len;
 	}
 
-	// check if we received an event notification
-	if (sam_rqid_is_event((cmd->rqid_hi << 8) | cmd->rqid_lo)) {
-		ssh_handle_event(ec, buf);
-		return msg_len;			// handled message
-	}
-
-	// check if we expect the message
-	if (rcv->state != SSH_RCV_COMMAND) {
-		dev_dbg(dev, SSH_RECV_TAG "discarding message: command not expected\n");
-		return msg_len;			// discard message
-	}
-
-	// check if response is for our request
-	if (rcv->expect.rqid != (cmd->rqid_lo | (cmd->rqid_hi << 8))) {
-		dev_dbg(dev, SSH_RECV_TAG "discarding message: command not a match\n");
-		return msg_len;			// discard message
-	}
-
-	// we now have a valid & expected command message
+	// we now have a valid command message (response or event)
 	dev_dbg(dev, SSH_RECV_TAG "valid command message received\n");
-
-	packet.type = ctrl->type;
-	packet.seq = ctrl->seq;
-	packet.len = cmd_end - cmd_begin_pld;
-
-	if (kfifo_avail(&rcv->fifo) >= sizeof(packet) + packet.len) {
-		kfifo_in(&rcv->fifo, &packet, sizeof(packet));
-		kfifo_in(&rcv->fifo, cmd_begin_pld, packet.len);
-
-	} else {
-		dev_warn(dev, SSH_RECV_TAG
-			 "dropping frame: not enough space in fifo (type = %d)\n",
-			 ctrl->type);
-
-		return SSH_MSG_LEN_CTRL;	// discard message
-	}
-
-	rcv->state = SSH_RCV_DISCARD;
-
-	complete(&rcv->signal);
+	ssh_receive_push_frame(ec, buf, msg_len);
 	return msg_len;				// handled message
 }
 
@@ -1153,7 +3608,7 @@ static int ssh_eval_buf(struct sam_ssh_ec *ec, const u8 *buf, size_t size)
 	// make sure we're actually at the start of a new message
 	if (!ssh_is_valid_syn(buf)) {
 		dev_err(dev, SSH_RECV_TAG "invalid start of message\n");
-		return size;		// discard everything
+		return ssh_receive_resync(ec, buf, size);	// skip to next SYN
 	}
 
 	// handle individual message types seperately
@@ -1170,7 +3625,60 @@ static int ssh_eval_buf(struct sam_ssh_ec *ec, const u8 *buf, size_t size)
 
 	default:
 		dev_err(dev, SSH_RECV_TAG "unknown frame type 0x%02x\n", ctrl->type);
-		return size;		// discard everything
+		return ssh_receive_resync(ec, buf, size);	// skip to next SYN
+	}
+}
+
+inline static unsigned int ssh_ring_len(const struct ssh_receiver *rcv)
+{
+	return rcv->ring.head - rcv->ring.tail;
+}
+
+static size_t ssh_ring_in(struct ssh_receiver *rcv, const u8 *buf, size_t size)
+{
+	unsigned int offs = rcv->ring.head & (SSH_RING_BUF_LEN - 1);
+	size_t n, l;
+
+	n = min(size, (size_t)(SSH_RING_BUF_LEN - ssh_ring_len(rcv)));
+	l = min(n, (size_t)(SSH_RING_BUF_LEN - offs));
+
+	memcpy(rcv->ring.ptr + offs, buf, l);
+	memcpy(rcv->ring.ptr, buf + l, n - l);
+
+	rcv->ring.head += n;
+	return n;
+}
+
+/*
+ * Evaluate the ring buffer until we need more bytes or it is empty. Messages
+ * are evaluated in place. Only if a message wraps around the end of the ring
+ * we linearize it into a separate buffer, the ring itself is never moved.
+ */
+static void ssh_ring_eval(struct sam_ssh_ec *ec)
+{
+	struct ssh_receiver *rcv = &ec->receiver;
+	unsigned int offs, len, seg;
+	int n;
+
+	while ((len = ssh_ring_len(rcv))) {
+		offs = rcv->ring.tail & (SSH_RING_BUF_LEN - 1);
+		seg = min(len, SSH_RING_BUF_LEN - offs);
+
+		n = ssh_eval_buf(ec, rcv->ring.ptr + offs, seg);
+
+		// message wraps around, evaluate a linear copy of it
+		if (n == 0 && seg < len) {
+			len = min(len, (unsigned int)SSH_EVAL_BUF_LEN);
+
+			memcpy(rcv->ring.lin, rcv->ring.ptr + offs, seg);
+			memcpy(rcv->ring.lin + seg, rcv->ring.ptr, len - seg);
+
+			n = ssh_eval_buf(ec, rcv->ring.lin, len);
+		}
+
+		if (n <= 0) break;	// need more bytes
+
+		rcv->ring.tail += n;
 	}
 }
 
@@ -1180,36 +3688,34 @@ static int ssh_receive_buf(struct serdev_device *serdev,
 	struct sam_ssh_ec *ec = serdev_device_get_drvdata(serdev);
 	struct ssh_receiver *rcv = &ec->receiver;
 	unsigned long flags;
-	int offs = 0;
+	size_t offs = 0;
 	int used, n;
 
 	dev_dbg(&serdev->dev, SSH_RECV_TAG "received buffer (size: %zu)\n", size);
 	print_hex_dump_debug(SSH_RECV_TAG, DUMP_PREFIX_OFFSET, 16, 1, buf, size, false);
 
-	/*
-	 * The battery _BIX message gets a bit long, thus we have to add some
-	 * additional buffering here.
-	 */
-
 	spin_lock_irqsave(&rcv->lock, flags);
+	rcv->rx_time = ktime_get();
 
-	// copy to eval-buffer
-	used = min(size, (size_t)(rcv->eval_buf.cap - rcv->eval_buf.len));
-	memcpy(rcv->eval_buf.ptr + rcv->eval_buf.len, buf, used);
-	rcv->eval_buf.len += used;
+	if (ssh_ring_len(rcv) == 0) {
+		// nothing buffered: evaluate directly, only store the remainder
+		while (offs < size) {
+			n = ssh_eval_buf(ec, buf + offs, size - offs);
+			if (n <= 0) break;	// need more bytes
 
-	// evaluate buffer until we need more bytes or eval-buf is empty
-	while (offs < rcv->eval_buf.len) {
-		n = rcv->eval_buf.len - offs;
-		n = ssh_eval_buf(ec, rcv->eval_buf.ptr + offs, n);
-		if (n <= 0) break;	// need more bytes
+			offs += n;
+		}
 
-		offs += n;
-	}
+		used = offs + ssh_ring_in(rcv, buf + offs, size - offs);
 
-	// throw away the evaluated parts
-	rcv->eval_buf.len -= offs;
-	memmove(rcv->eval_buf.ptr, rcv->eval_buf.ptr + offs, rcv->eval_buf.len);
+	} else {
+		/*
+		 * The battery _BIX message gets a bit long and may be split
+		 * across multiple calls, continue with what we have buffered.
+		 */
+		used = ssh_ring_in(rcv, buf, size);
+		ssh_ring_eval(ec);
+	}
 
 	spin_unlock_irqrestore(&rcv->lock, flags);
 
@@ -1217,6 +3723,177 @@ static int ssh_receive_buf(struct serdev_device *serdev,
 }
 
 
+/*
+ * Link watchdog.
+ */
+
+static void ssh_watchdog_sample(struct sam_ssh_ec *ec, struct ssh_link_sample *s)
+{
+	unsigned long flags;
+
+	s->timeouts = atomic_read(&ec->rtl.num_timeout);
+
+	spin_lock_irqsave(&ec->receiver.lock, flags);
+	s->rx_errors = ec->receiver.num_resync + ec->receiver.num_nak;
+	s->rx_time = ec->receiver.rx_time;
+	spin_unlock_irqrestore(&ec->receiver.lock, flags);
+
+	spin_lock_irqsave(&ec->rtl.lock, flags);
+	s->pending = ec->rtl.num_pending;
+	spin_unlock_irqrestore(&ec->rtl.lock, flags);
+}
+
+/*
+ * Compare two samples, returns the reason why the link is considered wedged
+ * or NULL if it is fine.
+ */
+static const char *ssh_link_check(const struct ssh_link_sample *old,
+				  const struct ssh_link_sample *new)
+{
+	if (new->timeouts - old->timeouts >= SSH_WATCHDOG_TIMEOUTS)
+		return "repeated request timeouts";
+
+	if (new->rx_errors - old->rx_errors >= SSH_WATCHDOG_RX_ERRORS)
+		return "burst of receive errors";
+
+	// requests have been in flight for a whole interval without any reply
+	if (old->pending && new->pending && old->rx_time == new->rx_time)
+		return "receiver stalled";
+
+	return NULL;
+}
+
+/*
+ * Drop everything the receiver has buffered, including frames and ACKs
+ * that have not been dispatched or sent yet, and any data not yet written
+ * to the device. The EC re-sends anything we did not ACK.
+ */
+static void ssh_receiver_reset(struct sam_ssh_ec *ec)
+{
+	struct ssh_receiver *rcv = &ec->receiver;
+	unsigned long flags;
+
+	tasklet_disable(&rcv->dispatch);
+
+	spin_lock_irqsave(&rcv->lock, flags);
+	kfifo_reset(&rcv->fifo);
+	rcv->nak_pending = false;
+	rcv->ring.head = 0;
+	rcv->ring.tail = 0;
+	rcv->frames.tail = rcv->frames.head;
+	spin_unlock_irqrestore(&rcv->lock, flags);
+
+	tasklet_enable(&rcv->dispatch);
+
+	mutex_lock(&ec->rtl.tx_lock);
+	serdev_device_write_flush(ec->serdev);
+	mutex_unlock(&ec->rtl.tx_lock);
+}
+
+/*
+ * Re-initialize the link: reset the receiver, resume the EC, and enable all
+ * event sources that are currently in use again. The EC resume request is
+ * sent even if the breaker is open, it closes the breaker on success. Must
+ * be called with the EC lock held (shared).
+ */
+static int ssh_link_recover(struct sam_ssh_ec *ec)
+{
+	struct device *dev = &ec->serdev->dev;
+	int status, i;
+
+	ssh_receiver_reset(ec);
+
+	// the EC may have lost its state, as well as any event
+	ssh_cache_clear(&ec->cache);
+
+	status = surface_sam_ssh_ec_resume(ec);
+	if (status) {
+		dev_err(dev, "failed to resume EC during link recovery: %d\n", status);
+		return status;
+	}
+
+	mutex_lock(&ec->events.source_lock);
+	for (i = 0; i < SAM_NUM_EVENT_TYPES; i++) {
+		if (!ec->events.source[i].refcount)
+			continue;
+
+		status = __surface_sam_ssh_enable_event_source(ec, ec->events.source[i].tc,
+							       ec->events.source[i].unknown,
+							       i + 1);
+		if (status) {
+			dev_err(dev, "failed to re-enable event source %04x: %d\n", i + 1, status);
+			break;
+		}
+	}
+	mutex_unlock(&ec->events.source_lock);
+
+	return status;
+}
+
+static void ssh_watchdog_fn(struct work_struct *work)
+{
+	struct sam_ssh_ec *ec = container_of(to_delayed_work(work), struct sam_ssh_ec, watchdog.work);
+	struct ssh_watchdog *wd = &ec->watchdog;
+	struct ssh_link_sample now;
+	const char *reason;
+
+	// not restarted here if suspended, resume restarts the watchdog
+	if (!surface_sam_ssh_acquire_shared_init())
+		return;
+
+	if (ec->state != SSH_EC_INITIALIZED) {
+		surface_sam_ssh_release_shared(ec);
+		return;
+	}
+
+	ssh_watchdog_sample(ec, &now);
+	reason = ssh_link_check(&wd->last, &now);
+	wd->last = now;
+
+	if (reason) {
+		dev_warn(&ec->serdev->dev, "link wedged (%s), re-initializing\n", reason);
+
+		if (ssh_link_recover(ec)) {
+			wd->num_failed += 1;
+			wd->backoff = min(wd->backoff + 1, (unsigned int)SSH_WATCHDOG_BACKOFF_MAX);
+		} else {
+			wd->num_recovered += 1;
+			wd->backoff = 0;
+			dev_info(&ec->serdev->dev, "link re-initialized\n");
+		}
+
+		// don't count anything caused by the recovery itself
+		ssh_watchdog_sample(ec, &wd->last);
+	}
+
+	surface_sam_ssh_release_shared(ec);
+
+	// don't keep hammering an EC that does not come back
+	queue_delayed_work(wd->queue, &wd->work, wd->interval << wd->backoff);
+}
+
+/*
+ * Start and stop the watchdog. The watchdog sends requests (and thus takes
+ * the EC lock), it must not be stopped with the EC lock held.
+ */
+static void ssh_watchdog_start(struct sam_ssh_ec *ec)
+{
+	struct ssh_watchdog *wd = &ec->watchdog;
+
+	if (!wd->interval)
+		return;
+
+	wd->backoff = 0;
+	ssh_watchdog_sample(ec, &wd->last);
+	queue_delayed_work(wd->queue, &wd->work, wd->interval);
+}
+
+static void ssh_watchdog_stop(struct sam_ssh_ec *ec)
+{
+	cancel_delayed_work_sync(&ec->watchdog.work);
+}
+
+
 static const struct acpi_gpio_params gpio_sam_wakeup_int = { 0, 0, false };
 static const struct acpi_gpio_params gpio_sam_wakeup     = { 1, 0, false };
 
@@ -1322,10 +3999,21 @@ static int surface_sam_ssh_suspend(struct device *dev)
 
 	dev_dbg(dev, "suspending\n");
 
+	ec = dev_get_drvdata(dev);
+	if (ec) {
+		ssh_watchdog_stop(ec);
+	}
+
 	ec = surface_sam_ssh_acquire_init();
 	if (ec) {
+		// make sure all asynchronous requests (and probes) have been completed
+		ssh_breaker_stop(ec);
+		ssh_rtl_flush(ec);
+
 		status = surface_sam_ssh_ec_suspend(ec);
 		if (status) {
+			ssh_breaker_start(ec);
+			ssh_watchdog_start(ec);
 			surface_sam_ssh_release(ec);
 			return status;
 		}
@@ -1333,6 +4021,8 @@ static int surface_sam_ssh_suspend(struct device *dev)
 		if (device_may_wakeup(dev)) {
 			status = enable_irq_wake(ec->irq);
 			if (status) {
+				ssh_breaker_start(ec);
+				ssh_watchdog_start(ec);
 				surface_sam_ssh_release(ec);
 				return status;
 			}
@@ -1372,12 +4062,17 @@ static int surface_sam_ssh_resume(struct device *dev)
 			ec->irq_wakeup_enabled = false;
 		}
 
+		// anything may have changed while we were asleep
+		ssh_cache_clear(&ec->cache);
+		ssh_breaker_start(ec);
+
 		status = surface_sam_ssh_ec_resume(ec);
 		if (status) {
 			surface_sam_ssh_release(ec);
 			return status;
 		}
 
+		ssh_watchdog_start(ec);
 		surface_sam_ssh_release(ec);
 	}
 
@@ -1396,17 +4091,232 @@ static const struct serdev_device_ops ssh_device_ops = {
 int surface_sam_ssh_sysfs_register(struct device *dev);
 void surface_sam_ssh_sysfs_unregister(struct device *dev);
 
+
+/*
+ * Link statistics, exposed via the "ssh" attribute group of the device.
+ */
+
+static ssize_t ssh_rtt_show(struct device *dev, const struct ssh_rtt *rtt, char *buf)
+{
+	struct sam_ssh_ec *ec = dev_get_drvdata(dev);
+	struct ssh_rtt val;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ec->rtl.lock, flags);
+	val = *rtt;
+	spin_unlock_irqrestore(&ec->rtl.lock, flags);
+
+	return sprintf(buf, "srtt_us=%u rttvar_us=%u rto_us=%u samples=%u\n",
+		       val.srtt, val.rttvar, val.rto, val.samples);
+}
+
+static ssize_t rtt_ack_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct sam_ssh_ec *ec = dev_get_drvdata(dev);
+
+	return ssh_rtt_show(dev, &ec->rtl.rtt_ack, buf);
+}
+
+static ssize_t rtt_rsp_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct sam_ssh_ec *ec = dev_get_drvdata(dev);
+
+	return ssh_rtt_show(dev, &ec->rtl.rtt_rsp, buf);
+}
+
+static ssize_t rx_discards_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct sam_ssh_ec *ec = dev_get_drvdata(dev);
+	unsigned int resyncs, bytes;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ec->receiver.lock, flags);
+	resyncs = ec->receiver.num_resync;
+	bytes = ec->receiver.num_discarded;
+	spin_unlock_irqrestore(&ec->receiver.lock, flags);
+
+	return sprintf(buf, "resyncs=%u bytes=%u\n", resyncs, bytes);
+}
+
+static ssize_t rx_frames_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct sam_ssh_ec *ec = dev_get_drvdata(dev);
+
+	return sprintf(buf, "extracted=%u dropped=%u dispatched=%u\n",
+		       READ_ONCE(ec->receiver.frames.num_extracted),
+		       READ_ONCE(ec->receiver.frames.num_dropped),
+		       READ_ONCE(ec->receiver.frames.num_dispatched));
+}
+
+static ssize_t rx_naks_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct sam_ssh_ec *ec = dev_get_drvdata(dev);
+	unsigned int naks;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ec->receiver.lock, flags);
+	naks = ec->receiver.num_nak;
+	spin_unlock_irqrestore(&ec->receiver.lock, flags);
+
+	return sprintf(buf, "%u\n", naks);
+}
+
+static ssize_t retransmits_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct sam_ssh_ec *ec = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", atomic_read(&ec->rtl.num_retransmit));
+}
+
+static ssize_t timeouts_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct sam_ssh_ec *ec = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", atomic_read(&ec->rtl.num_timeout));
+}
+
+static ssize_t events_merged_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct sam_ssh_ec *ec = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", atomic_read(&ec->events.num_merged));
+}
+
+static ssize_t events_dropped_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct sam_ssh_ec *ec = dev_get_drvdata(dev);
+	unsigned int dropped;
+	ssize_t len = 0;
+	int i;
+
+	// one line per source that exceeded its rate limit
+	for (i = 0; i < SAM_NUM_EVENT_TYPES; i++) {
+		dropped = READ_ONCE(ec->events.bucket[i].num_dropped);
+		if (dropped)
+			len += sprintf(buf + len, "rqid=%02x dropped=%u\n", i + 1, dropped);
+	}
+
+	return len;
+}
+
+static ssize_t events_duplicate_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct sam_ssh_ec *ec = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%u\n", READ_ONCE(ec->events.num_duplicate));
+}
+
+static ssize_t rqst_shared_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct sam_ssh_ec *ec = dev_get_drvdata(dev);
+
+	return sprintf(buf, "%d\n", atomic_read(&ec->flights.num_shared));
+}
+
+static ssize_t rqst_cache_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct sam_ssh_ec *ec = dev_get_drvdata(dev);
+	unsigned int hit, miss, invalidated, entries;
+
+	mutex_lock(&ec->cache.lock);
+	hit = ec->cache.num_hit;
+	miss = ec->cache.num_miss;
+	invalidated = ec->cache.num_invalidated;
+	entries = ec->cache.num_entries;
+	mutex_unlock(&ec->cache.lock);
+
+	return sprintf(buf, "hits=%u misses=%u invalidated=%u entries=%u\n",
+		       hit, miss, invalidated, entries);
+}
+
+static ssize_t rqst_breaker_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	static const char *const names[] = {
+		[SSH_BREAKER_CLOSED]  = "closed",
+		[SSH_BREAKER_OPEN]    = "open",
+		[SSH_BREAKER_PROBING] = "probing",
+	};
+
+	struct sam_ssh_ec *ec = dev_get_drvdata(dev);
+	unsigned int failed, trips, rejected;
+	enum ssh_breaker_state state;
+	unsigned long flags;
+
+	spin_lock_irqsave(&ec->rtl.lock, flags);
+	state = ec->rtl.breaker.state;
+	failed = ec->rtl.breaker.num_failed;
+	trips = ec->rtl.breaker.num_trip;
+	rejected = ec->rtl.breaker.num_rejected;
+	spin_unlock_irqrestore(&ec->rtl.lock, flags);
+
+	return sprintf(buf, "state=%s failed=%u trips=%u rejected=%u\n",
+		       names[state], failed, trips, rejected);
+}
+
+static ssize_t link_recoveries_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	struct sam_ssh_ec *ec = dev_get_drvdata(dev);
+
+	return sprintf(buf, "recovered=%u failed=%u\n",
+		       READ_ONCE(ec->watchdog.num_recovered),
+		       READ_ONCE(ec->watchdog.num_failed));
+}
+
+static DEVICE_ATTR_RO(rtt_ack);
+static DEVICE_ATTR_RO(rtt_rsp);
+static DEVICE_ATTR_RO(rx_discards);
+static DEVICE_ATTR_RO(rx_frames);
+static DEVICE_ATTR_RO(rx_naks);
+static DEVICE_ATTR_RO(retransmits);
+static DEVICE_ATTR_RO(timeouts);
+static DEVICE_ATTR_RO(events_merged);
+static DEVICE_ATTR_RO(events_dropped);
+static DEVICE_ATTR_RO(events_duplicate);
+static DEVICE_ATTR_RO(rqst_shared);
+static DEVICE_ATTR_RO(rqst_cache);
+static DEVICE_ATTR_RO(rqst_breaker);
+static DEVICE_ATTR_RO(link_recoveries);
+
+static struct attribute *ssh_stats_attrs[] = {
+	&dev_attr_rtt_ack.attr,
+	&dev_attr_rtt_rsp.attr,
+	&dev_attr_rx_discards.attr,
+	&dev_attr_rx_frames.attr,
+	&dev_attr_rx_naks.attr,
+	&dev_attr_retransmits.attr,
+	&dev_attr_timeouts.attr,
+	&dev_attr_events_merged.attr,
+	&dev_attr_events_dropped.attr,
+	&dev_attr_events_duplicate.attr,
+	&dev_attr_rqst_shared.attr,
+	&dev_attr_rqst_cache.attr,
+	&dev_attr_rqst_breaker.attr,
+	&dev_attr_link_recoveries.attr,
+	NULL,
+};
+
+static const struct attribute_group ssh_stats_group = {
+	.name = "ssh",
+	.attrs = ssh_stats_attrs,
+};
+
 static int surface_sam_ssh_probe(struct serdev_device *serdev)
 {
 	struct sam_ssh_ec *ec;
 	struct workqueue_struct *event_queue_ack;
 	struct workqueue_struct *event_queue_evt;
-	u8 *write_buf;
+	struct workqueue_struct *rqst_queue;
+	struct workqueue_struct *watchdog_queue;
+	struct task_struct *event_thread = NULL;
+	unsigned int window;
+	u8 *tx_buf;
 	u8 *read_buf;
-	u8 *eval_buf;
+	u8 *ring_buf;
+	struct ssh_frame_slot *frame_buf;
+	struct ssh_event_pool event_pool[SSH_NUM_EVENT_POOLS];
 	acpi_handle *ssh = ACPI_HANDLE(&serdev->dev);
 	acpi_status status;
-	int irq;
+	int irq, i;
 
 	dev_dbg(&serdev->dev, "probing\n");
 
@@ -1417,11 +4327,16 @@ static int surface_sam_ssh_probe(struct serdev_device *serdev)
 	if (status)
 		return status;
 
+	ssh_crc_init();
+	ssh_crc_selftest(&serdev->dev);
+
+	window = clamp_t(unsigned int, rqst_window, 1, SSH_RQST_WINDOW_MAX);
+
 	// allocate buffers
-	write_buf = kzalloc(SSH_WRITE_BUF_LEN, GFP_KERNEL);
-	if (!write_buf) {
+	tx_buf = kzalloc(window * SSH_MAX_WRITE + SSH_ACK_BATCH_MAX * SSH_MSG_LEN_CTRL, GFP_KERNEL);
+	if (!tx_buf) {
 		status = -ENOMEM;
-		goto err_write_buf;
+		goto err_tx_buf;
 	}
 
 	read_buf = kzalloc(SSH_READ_BUF_LEN, GFP_KERNEL);
@@ -1430,10 +4345,21 @@ static int surface_sam_ssh_probe(struct serdev_device *serdev)
 		goto err_read_buf;
 	}
 
-	eval_buf = kzalloc(SSH_EVAL_BUF_LEN, GFP_KERNEL);
-	if (!eval_buf) {
+	ring_buf = kzalloc(SSH_RING_BUF_LEN + SSH_EVAL_BUF_LEN, GFP_KERNEL);
+	if (!ring_buf) {
+		status = -ENOMEM;
+		goto err_ring_buf;
+	}
+
+	frame_buf = kcalloc(SSH_FRAME_RING_LEN, sizeof(struct ssh_frame_slot), GFP_KERNEL);
+	if (!frame_buf) {
 		status = -ENOMEM;
-		goto err_eval_buf;
+		goto err_frame_buf;
+	}
+
+	status = ssh_event_pools_init(event_pool);
+	if (status) {
+		goto err_evtpool;
 	}
 
 	event_queue_ack = create_singlethread_workqueue("surface_sh_ackq");
@@ -1448,6 +4374,26 @@ static int surface_sam_ssh_probe(struct serdev_device *serdev)
 		goto err_evtq;
 	}
 
+	rqst_queue = create_singlethread_workqueue("surface_sh_rqstq");
+	if (!rqst_queue) {
+		status = -ENOMEM;
+		goto err_rqstq;
+	}
+
+	watchdog_queue = create_singlethread_workqueue("surface_sh_wdq");
+	if (!watchdog_queue) {
+		status = -ENOMEM;
+		goto err_wdq;
+	}
+
+	if (event_rt_thread) {
+		event_thread = ssh_event_rt_thread_create(&ssh_ec);
+		if (IS_ERR(event_thread)) {
+			status = PTR_ERR(event_thread);
+			goto err_evtthread;
+		}
+	}
+
 	irq = surface_sam_setup_irq(serdev);
 	if (irq < 0) {
 		status = irq;
@@ -1466,19 +4412,40 @@ static int surface_sam_ssh_probe(struct serdev_device *serdev)
 
 	ec->serdev      = serdev;
 	ec->irq         = irq;
-	ec->writer.data = write_buf;
-	ec->writer.ptr  = write_buf;
+
+	// initialize request transport
+	ec->rtl.window = window;
+	ec->rtl.tx_buf = tx_buf;
+	ec->rtl.queue = rqst_queue;
+	INIT_WORK(&ec->rtl.tx_work, ssh_rtl_tx_work_fn);
+	INIT_WORK(&ec->rtl.ack_work, ssh_rtl_ack_work_fn);
+	INIT_DELAYED_WORK(&ec->rtl.breaker.probe, ssh_breaker_probe_fn);
+	ec->rtl.breaker.state = SSH_BREAKER_CLOSED;
+	ec->rtl.breaker.num_failed = 0;
+
+	// initialize link watchdog
+	ec->watchdog.queue = watchdog_queue;
+	INIT_DELAYED_WORK(&ec->watchdog.work, ssh_watchdog_fn);
+	ec->watchdog.interval = msecs_to_jiffies(link_watchdog_interval);
 
 	// initialize receiver
-	init_completion(&ec->receiver.signal);
 	kfifo_init(&ec->receiver.fifo, read_buf, SSH_READ_BUF_LEN);
-	ec->receiver.eval_buf.ptr = eval_buf;
-	ec->receiver.eval_buf.cap = SSH_EVAL_BUF_LEN;
-	ec->receiver.eval_buf.len = 0;
+	ec->receiver.ring.ptr  = ring_buf;
+	ec->receiver.ring.lin  = ring_buf + SSH_RING_BUF_LEN;
+	ec->receiver.ring.head = 0;
+	ec->receiver.ring.tail = 0;
+	ec->receiver.frames.slot = frame_buf;
+	ec->receiver.frames.head = 0;
+	ec->receiver.frames.tail = 0;
+	tasklet_init(&ec->receiver.dispatch, ssh_receive_dispatch_fn, (unsigned long)ec);
 
 	// initialize event handling
 	ec->events.queue_ack = event_queue_ack;
 	ec->events.queue_evt = event_queue_evt;
+	ec->events.rt.thread = event_thread;
+	memcpy(ec->events.pool, event_pool, sizeof(event_pool));
+	for (i = 0; i < SAM_NUM_EVENT_TYPES; i++)
+		INIT_LIST_HEAD(&ec->events.handlers[i]);
 
 	ec->state = SSH_EC_INITIALIZED;
 
@@ -1509,6 +4476,14 @@ static int surface_sam_ssh_probe(struct serdev_device *serdev)
 		goto err_devinit;
 	}
 
+	status = sysfs_create_group(&serdev->dev.kobj, &ssh_stats_group);
+	if (status) {
+		surface_sam_ssh_sysfs_unregister(&serdev->dev);
+		goto err_devinit;
+	}
+
+	ssh_breaker_start(ec);
+	ssh_watchdog_start(ec);
 	surface_sam_ssh_release(ec);
 
 	// TODO: The EC can wake up the system via the associated GPIO interrupt in
@@ -1526,6 +4501,7 @@ static int surface_sam_ssh_probe(struct serdev_device *serdev)
 
 err_devinit:
 	serdev_device_close(serdev);
+	tasklet_kill(&ec->receiver.dispatch);
 err_open:
 	ec->state = SSH_EC_UNINITIALIZED;
 	serdev_device_set_drvdata(serdev, NULL);
@@ -1533,24 +4509,42 @@ err_open:
 err_busy:
 	free_irq(irq, serdev);
 err_irq:
+	if (event_thread)
+		kthread_stop(event_thread);
+err_evtthread:
+	destroy_workqueue(watchdog_queue);
+err_wdq:
+	destroy_workqueue(rqst_queue);
+err_rqstq:
 	destroy_workqueue(event_queue_evt);
 err_evtq:
 	destroy_workqueue(event_queue_ack);
 err_ackq:
-	kfree(eval_buf);
-err_eval_buf:
+	ssh_event_pools_destroy(event_pool);
+err_evtpool:
+	kfree(frame_buf);
+err_frame_buf:
+	kfree(ring_buf);
+err_ring_buf:
 	kfree(read_buf);
 err_read_buf:
-	kfree(write_buf);
-err_write_buf:
+	kfree(tx_buf);
+err_tx_buf:
 	return status;
 }
 
 static void surface_sam_ssh_remove(struct serdev_device *serdev)
 {
+	struct ssh_event_handler *h, *n;
 	struct sam_ssh_ec *ec;
+	LIST_HEAD(handlers);
 	unsigned long flags;
-	int status;
+	int status, i;
+
+	ec = serdev_device_get_drvdata(serdev);
+	if (ec) {
+		ssh_watchdog_stop(ec);
+	}
 
 	ec = surface_sam_ssh_acquire_init();
 	if (!ec) {
@@ -1558,9 +4552,12 @@ static void surface_sam_ssh_remove(struct serdev_device *serdev)
 	}
 
 	free_irq(ec->irq, serdev);
+	sysfs_remove_group(&serdev->dev.kobj, &ssh_stats_group);
 	surface_sam_ssh_sysfs_unregister(&serdev->dev);
 
 	// suspend EC and disable events
+	ssh_breaker_stop(ec);
+	ssh_rtl_flush(ec);
 	status = surface_sam_ssh_ec_suspend(ec);
 	if (status) {
 		dev_err(&serdev->dev, "failed to suspend EC: %d\n", status);
@@ -1570,12 +4567,25 @@ static void surface_sam_ssh_remove(struct serdev_device *serdev)
 	flush_workqueue(ec->events.queue_ack);
 	flush_workqueue(ec->events.queue_evt);
 
-	// remove event handlers
-	spin_lock_irqsave(&ec->events.lock, flags);
-	memset(ec->events.handler, 0,
-	       sizeof(struct ssh_event_handler)
-	        * SAM_NUM_EVENT_TYPES);
-	spin_unlock_irqrestore(&ec->events.lock, flags);
+	// remove event handlers, notifiers of the old interface are ours
+	for (i = 0; i < SAM_NUM_EVENT_TYPES; i++) {
+		list_splice_init_rcu(&ec->events.handlers[i], &handlers, synchronize_rcu);
+
+		kfree(ec->events.legacy[i]);
+		ec->events.legacy[i] = NULL;
+	}
+
+	list_for_each_entry_safe(h, n, &handlers, node) {
+		list_del(&h->node);
+		ssh_event_handler_free(ec, h);
+	}
+
+	// the EC has been suspended, thus all event sources are disabled
+	mutex_lock(&ec->events.source_lock);
+	memset(ec->events.source, 0, sizeof(ec->events.source));
+	mutex_unlock(&ec->events.source_lock);
+
+	ssh_cache_clear(&ec->cache);
 
 	// set device to deinitialized state
 	ec->state  = SSH_EC_UNINITIALIZED;
@@ -1592,6 +4602,7 @@ static void surface_sam_ssh_remove(struct serdev_device *serdev)
 	flush_workqueue(ec->events.queue_evt);
 
 	serdev_device_close(serdev);
+	tasklet_kill(&ec->receiver.dispatch);
 
 	/*
          * Only at this point, no new events can be received. Destroying the
@@ -1600,21 +4611,36 @@ static void surface_sam_ssh_remove(struct serdev_device *serdev)
 	 */
 	destroy_workqueue(ec->events.queue_ack);
 	destroy_workqueue(ec->events.queue_evt);
+	destroy_workqueue(ec->rtl.queue);
+	ec->rtl.queue = NULL;
+	destroy_workqueue(ec->watchdog.queue);
+	ec->watchdog.queue = NULL;
+
+	// the thread handles all remaining events before it stops
+	if (ec->events.rt.thread) {
+		kthread_stop(ec->events.rt.thread);
+		ec->events.rt.thread = NULL;
+	}
 
-	// free writer
-	kfree(ec->writer.data);
-	ec->writer.data = NULL;
-	ec->writer.ptr  = NULL;
+	ssh_event_pools_destroy(ec->events.pool);
+
+	kfree(ec->rtl.tx_buf);
+	ec->rtl.tx_buf = NULL;
 
 	// free receiver
 	spin_lock_irqsave(&ec->receiver.lock, flags);
-	ec->receiver.state = SSH_RCV_DISCARD;
 	kfifo_free(&ec->receiver.fifo);
 
-	kfree(ec->receiver.eval_buf.ptr);
-	ec->receiver.eval_buf.ptr = NULL;
-	ec->receiver.eval_buf.cap = 0;
-	ec->receiver.eval_buf.len = 0;
+	kfree(ec->receiver.ring.ptr);
+	ec->receiver.ring.ptr  = NULL;
+	ec->receiver.ring.lin  = NULL;
+	ec->receiver.ring.head = 0;
+	ec->receiver.ring.tail = 0;
+
+	kfree(ec->receiver.frames.slot);
+	ec->receiver.frames.slot = NULL;
+	ec->receiver.frames.head = 0;
+	ec->receiver.frames.tail = 0;
 	spin_unlock_irqrestore(&ec->receiver.lock, flags);
 
 	device_set_wakeup_capable(&serdev->dev, false);
@@ -12,6 +12,7 @@
 
 #include <linux/types.h>
 #include <linux/device.h>
+#include <linux/ktime.h>
 
 
 /*
@@ -35,12 +36,40 @@
 
 /*
  * Special event-handler delay value indicating that the corresponding event
- * should be handled immediately in the interrupt and not be relayed through
- * the workqueue. Intended for low-latency events, such as keyboard events.
+ * should be handled immediately and not be relayed through the workqueue.
+ * Such events are handled on a dedicated real-time thread or, if that is
+ * disabled via the event_rt_thread module parameter, directly in the
+ * receive dispatcher (softirq context). Intended for low-latency events,
+ * such as keyboard events.
  */
 #define SURFACE_SAM_SSH_EVENT_IMMEDIATE		((unsigned long) -1)
 
+/*
+ * Coalescing modes for delayed events. If enabled, an incoming event is
+ * merged into a not yet handled delayed event of the same RQID with the same
+ * target category, command ID, and instance ID, instead of being queued
+ * separately. The merged event carries the payload of the latest event.
+ * With SURFACE_SAM_SSH_EVENT_COALESCE_EXTEND, its delay is restarted as well.
+ */
+#define SURFACE_SAM_SSH_EVENT_COALESCE_NONE	0
+#define SURFACE_SAM_SSH_EVENT_COALESCE_LATEST	1
+#define SURFACE_SAM_SSH_EVENT_COALESCE_EXTEND	2
+
+/*
+ * Number of command IDs, i.e. bits in the command ID mask of a notifier.
+ */
+#define SURFACE_SAM_SSH_NUM_CIDS		256
+
+/*
+ * Target category of notifiers that want events of any target category.
+ */
+#define SURFACE_SAM_SSH_EVENT_TC_ANY		0x00
+
 
+/*
+ * Request and event priorities. Requests with SURFACE_SAM_PRIORITY_HIGH are
+ * sent ahead of queued normal-priority requests, without starving them.
+ */
 #define SURFACE_SAM_PRIORITY_NORMAL		1
 #define SURFACE_SAM_PRIORITY_HIGH		2
 
@@ -69,24 +98,154 @@ struct surface_sam_ssh_event {
 	u8  pri;			// priority
 	u8  len;			// length of payload
 	u8 *pld;			// payload of length len
+	ktime_t rx_time;		// receive time (ktime_get)
+	ktime_t dispatch_time;		// time of dispatch to handler queue
 };
 
 
+/*
+ * Completion callback for asynchronous requests. Called exactly once per
+ * successfully submitted request, with status being zero on success or a
+ * negative error code on failure. The callback runs on the request workqueue
+ * and must not wait for other requests to complete.
+ */
+typedef void (*surface_sam_ssh_rqst_complete_fn)(int status, struct surface_sam_ssh_buf *result, void *data);
+
 typedef int (*surface_sam_ssh_event_handler_fn)(struct surface_sam_ssh_event *event, void *data);
 typedef unsigned long (*surface_sam_ssh_event_handler_delay)(struct surface_sam_ssh_event *event, void *data);
 
 int surface_sam_ssh_consumer_register(struct device *consumer);
 
+/*
+ * Submit a request and wait for it to complete. After repeated timeouts, the
+ * EC is considered unresponsive and requests fail with -ETIMEDOUT without
+ * being sent, until the EC answers a periodic probe again. This applies to
+ * all request functions below.
+ */
 int surface_sam_ssh_rqst(const struct surface_sam_ssh_rqst *rqst, struct surface_sam_ssh_buf *result);
 
+/*
+ * Submit a read-only request, i.e. one without side effects. While such a
+ * request is in flight, identical requests (same target category, command
+ * ID, instance ID, priority, and payload) submitted via this function do not
+ * cause another round-trip, but wait for it and receive a copy of its
+ * response.
+ */
+int surface_sam_ssh_rqst_shared(const struct surface_sam_ssh_rqst *rqst, struct surface_sam_ssh_buf *result);
+
+/*
+ * Response cache for idempotent requests. Drivers opt commands in by
+ * registering a table of rules, each giving the time in milliseconds for
+ * which responses to the command may be reused. The table must stay valid
+ * until it is unregistered. Responses are cached per instance ID and
+ * payload, and only for requests submitted via surface_sam_ssh_rqst() (or
+ * surface_sam_ssh_rqst_shared()). Event handlers should invalidate responses
+ * they know to be outdated. All responses are dropped on resume.
+ */
+struct surface_sam_ssh_cache_rule {
+	u8 tc;				// target category
+	u8 cid;				// command ID
+	unsigned int ttl;		// time to live in milliseconds
+};
+
+int surface_sam_ssh_cache_register(const struct surface_sam_ssh_cache_rule *rules, unsigned int count);
+void surface_sam_ssh_cache_unregister(const struct surface_sam_ssh_cache_rule *rules);
+void surface_sam_ssh_cache_invalidate(u8 tc, u8 cid);
+
+/*
+ * Submit a request without waiting for it to complete. The request and its
+ * payload are copied, the result buffer (if any) must stay valid until the
+ * completion callback has been called. Must be called from a context that
+ * may sleep.
+ */
+int surface_sam_ssh_rqst_async(const struct surface_sam_ssh_rqst *rqst,
+		struct surface_sam_ssh_buf *result,
+		surface_sam_ssh_rqst_complete_fn complete,
+		void *complete_data);
+
+/*
+ * Submit multiple requests at once and wait for all of them to complete.
+ * Requests are sent in order, with their frames coalesced into as few writes
+ * as possible. The result array (and any of its entries) may be NULL. If
+ * status is non-NULL, it receives the individual status of each request.
+ * Returns the first non-zero status, or zero if all requests succeeded.
+ */
+int surface_sam_ssh_rqst_batch(const struct surface_sam_ssh_rqst *rqst,
+		struct surface_sam_ssh_buf **result,
+		int *status, unsigned int count);
+
+/*
+ * Enable or disable events of the given source on the EC. Sources are
+ * reference counted: The EC is only asked to enable a source for its first
+ * user and to disable it after its last user is gone.
+ */
 int surface_sam_ssh_enable_event_source(u8 tc, u8 unknown, u16 rqid);
 int surface_sam_ssh_disable_event_source(u8 tc, u8 unknown, u16 rqid);
+
+struct ssh_event_handler;
+
+/*
+ * Event notifier, subscribing to events of one RQID. Multiple notifiers may
+ * subscribe to the same RQID, each one receives the events matching its
+ * target category and command ID mask. Events of one notifier are handled in
+ * order, different notifiers may handle events concurrently. Notifiers with
+ * SURFACE_SAM_PRIORITY_HIGH run on a high-priority workqueue.
+ */
+struct surface_sam_ssh_event_notifier {
+	u16 rqid;				// event type/source ID
+	u8  tc;					// target category or SURFACE_SAM_SSH_EVENT_TC_ANY
+	u8  priority;				// workqueue priority
+	const unsigned long *cid_mask;		// command IDs (bitmap), NULL for all
+	surface_sam_ssh_event_handler_fn handler;
+	surface_sam_ssh_event_handler_delay delay;	// NULL for default
+	void *data;				// passed to handler and delay
+	u8  coalesce;				// SURFACE_SAM_SSH_EVENT_COALESCE_*
+
+	struct ssh_event_handler *priv;		// internal, set on registration
+};
+
+int surface_sam_ssh_notifier_register(struct surface_sam_ssh_event_notifier *nf);
+int surface_sam_ssh_notifier_unregister(struct surface_sam_ssh_event_notifier *nf);
+
+/*
+ * Register an event handler for all events of the given RQID. There can
+ * only be one handler registered via this interface per RQID, it is removed
+ * via surface_sam_ssh_remove_event_handler(). Use notifiers for anything else.
+ */
+int surface_sam_ssh_set_prioritized_event_handler(u16 rqid,
+		surface_sam_ssh_event_handler_fn fn,
+		surface_sam_ssh_event_handler_delay delay,
+		void *data, u8 priority);
+
 int surface_sam_ssh_remove_event_handler(u16 rqid);
 
-int surface_sam_ssh_set_delayed_event_handler(u16 rqid,
+/*
+ * Set the coalescing mode for delayed events of the handler registered for
+ * the given RQID via surface_sam_ssh_set_*event_handler(). Notifiers specify
+ * their mode on registration instead. Immediate and non-delayed events are
+ * never coalesced.
+ */
+int surface_sam_ssh_set_event_coalescing(u16 rqid, u8 mode);
+
+/*
+ * Limit the rate of events of the given RQID. Events exceeding the limit are
+ * acknowledged, but dropped (or merged, if coalescing is enabled). A rate or
+ * burst of zero selects the default given by the event_rate_limit and
+ * event_rate_burst module parameters. Registering the first handler or notifier
+ * of a source resets its limit to the default. Handlers registered with
+ * SURFACE_SAM_PRIORITY_HIGH are not subject to the default limit, only to a
+ * limit set explicitly via this function.
+ */
+int surface_sam_ssh_set_event_ratelimit(u16 rqid, unsigned int rate, unsigned int burst);
+
+static inline int surface_sam_ssh_set_delayed_event_handler(u16 rqid,
 		surface_sam_ssh_event_handler_fn fn,
 		surface_sam_ssh_event_handler_delay delay,
-		void *data);
+		void *data)
+{
+	return surface_sam_ssh_set_prioritized_event_handler(rqid, fn, delay, data,
+			SURFACE_SAM_PRIORITY_NORMAL);
+}
 
 static inline int surface_sam_ssh_set_event_handler(u16 rqid, surface_sam_ssh_event_handler_fn fn, void *data)
 {